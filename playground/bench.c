@@ -0,0 +1,272 @@
+#define _DEFAULT_SOURCE /* for clock_gettime() and getrusage() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#define VERA_IMPLEMENTATION
+#define VERA_RISCV32
+#include "vera.h"
+#define LITTLE_ENDIAN_HOST
+#define RV32_IMPLEMENTATION
+#define RV32_THREADS
+#include "rv32.h"
+
+/* Shape of a synthetic program */
+typedef struct {
+    unsigned int rule_count;
+    unsigned int lhs; /* facts per side */
+    unsigned int rhs;
+    unsigned int name_len; /* minimum length of the fact names */
+    unsigned int noise; /* maximum number of extra spaces around the facts and delimiters */
+    unsigned int port_count;
+} bench_config;
+
+static const bench_config configs[] = {
+    { 1000, 2, 2, 4, 0, 0 },
+    { 10000, 3, 2, 8, 1, 0 },
+    { 10000, 3, 2, 8, 1, 8 },
+    { 50000, 2, 3, 16, 4, 0 },
+    { 100000, 4, 4, 8, 2, 16 },
+};
+
+/* the emulated run stops after this many firings, random programs don't always terminate */
+#define BENCH_FUEL 10000
+/* instances of the program run by rv32_batch_run */
+#define BENCH_INSTANCES 64
+/* fuel of every instance of vera_batch_run, which scans the rules from the first one every step */
+#define BENCH_LANES_FUEL 1000
+
+static uint32_t bench_state;
+#define RANDOM(n) ((bench_state = bench_state * 1103515245 + 12345) >> 16) % (n)
+
+typedef struct {
+    char *data;
+    size_t len, capacity;
+} bench_buffer;
+
+static void bench_append(bench_buffer *buf, const char *str, size_t len) {
+    if(buf->len + len + 1 > buf->capacity) {
+        while(buf->len + len + 1 > buf->capacity)
+            buf->capacity = buf->capacity ? 2 * buf->capacity : 4096;
+        buf->data = (char*)realloc(buf->data, buf->capacity);
+        if(!buf->data) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+static void bench_noise(bench_buffer *buf, const bench_config *config) {
+    static const char spaces[] = "  \t \n   \t  ";
+    unsigned int n = config->noise ? RANDOM(config->noise + 1) : 0;
+    while(n--)
+        bench_append(buf, &spaces[RANDOM(sizeof(spaces) - 1)], 1);
+}
+
+/* Fact names are padded with a letter to `name_len` characters, the ports are facts too */
+static void bench_fact(bench_buffer *buf, const bench_config *config, unsigned int fact_count, char **port_names) {
+    char name[64];
+    int len;
+    if(config->port_count && RANDOM(8) == 0) {
+        len = sprintf(name, "%s", port_names[RANDOM(config->port_count)]);
+    } else {
+        len = sprintf(name, "f%u", RANDOM(fact_count));
+        while(len < config->name_len && len < sizeof(name) - 1)
+            name[len++] = 'x';
+    }
+    bench_noise(buf, config);
+    bench_append(buf, name, len);
+    bench_noise(buf, config);
+}
+
+static void bench_generate(bench_buffer *buf, const bench_config *config, char **port_names) {
+    const unsigned int fact_count = config->rule_count / 2 + 16;
+    char count[16];
+    buf->len = 0;
+    bench_state = 1;
+    /* every fact is seeded, so that the rules fire */
+    for(unsigned int i = 0; i < fact_count; i++) {
+        bench_append(buf, "||", 2);
+        bench_fact(buf, config, fact_count, port_names);
+        bench_append(buf, count, sprintf(count, ": %u\n", 1 + RANDOM(1000)));
+    }
+    for(unsigned int i = 0; i < config->rule_count; i++) {
+        bench_append(buf, "|", 1);
+        for(unsigned int j = 0; j < config->lhs; j++) {
+            if(j)
+                bench_append(buf, ",", 1);
+            bench_fact(buf, config, fact_count, port_names);
+            if(RANDOM(4) == 0)
+                bench_append(buf, "?", 1);
+        }
+        bench_append(buf, "|", 1);
+        for(unsigned int j = 0; j < config->rhs; j++) {
+            if(j)
+                bench_append(buf, ",", 1);
+            bench_fact(buf, config, fact_count, port_names);
+            bench_append(buf, count, sprintf(count, ": %u", 1 + RANDOM(3)));
+        }
+        bench_append(buf, "\n", 1);
+    }
+}
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* in MB, for the whole process so far */
+static double bench_peak_rss(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+static void bench_run(const bench_config *config) {
+    bench_buffer src = { NULL, 0, 0 };
+    char **port_names = (char**)malloc((config->port_count + 1) * sizeof(char*));
+    for(unsigned int i = 0; i < config->port_count; i++) {
+        port_names[i] = (char*)malloc(16);
+        sprintf(port_names[i], "@port%u", i);
+    }
+    bench_generate(&src, config, port_names);
+    printf("%u rules, %u + %u facts, names of %u, noise %u, %u ports : %.2f MB of source\n",
+           config->rule_count, config->lhs, config->rhs, config->name_len, config->noise,
+           config->port_count, src.len / 1e6);
+
+    vera_ctx ctx;
+    double t = bench_now();
+    vera_init_ctx_len(&ctx, src.data, src.len);
+    vera_add_ports(&ctx, (const char**)port_names, config->port_count);
+    vera_parse(&ctx);
+    double elapsed = bench_now() - t;
+    printf("  parse    %9.2f ms  %8.1f MB/s     %u objects\n", elapsed * 1e3, src.len / 1e6 / elapsed, ctx.obj_count);
+
+    t = bench_now();
+    vera_intern_strings(&ctx);
+    elapsed = bench_now() - t;
+    printf("  intern   %9.2f ms  %8.2f Mobj/s   %u registers\n", elapsed * 1e3, ctx.obj_count / 1e6 / elapsed, ctx.register_count);
+
+    t = bench_now();
+    const size_t code_size = vera_riscv32_codegen(&ctx, NULL, 0);
+    const size_t ram_size = (code_size + 0xffff) & ~(size_t)0xffff;
+    uint8_t *memory = (uint8_t*)malloc(RV32_NEEDED_MEMORY(ram_size));
+    void *icache = malloc(RV32_ICACHE_NEEDED_MEMORY(code_size));
+    if(!memory || !icache) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    RV32 *rv32 = rv32_new(memory, ram_size);
+    vera_riscv32_codegen(&ctx, rv32->mem, ram_size);
+    elapsed = bench_now() - t;
+    printf("  codegen  %9.2f ms  %8.1f KB/s     %zu bytes of code\n", elapsed * 1e3, code_size / 1e3 / elapsed, code_size);
+
+    uint64_t instructions = 0;
+    t = bench_now();
+    rv32_attach_icache(rv32, icache, code_size);
+    rv32->r[REG_A1] = BENCH_FUEL;
+    while(rv32->status == RV32_RUNNING)
+        instructions += rv32_run(rv32, 1 << 24);
+    elapsed = bench_now() - t;
+    if(rv32->status != RV32_EBREAK) {
+        fprintf(stderr, "error %d at pc=%08x\n", rv32->status, rv32->pc);
+        exit(1);
+    }
+    printf("  run      %9.2f ms  %8.1f MIPS     %u firings (%.2f M/s)\n", elapsed * 1e3,
+           instructions / 1e6 / elapsed, rv32->r[REG_A0], rv32->r[REG_A0] / 1e6 / elapsed);
+    free(icache);
+    free(memory);
+
+    /* the interpreter on instances side by side, VERA_BATCH_LANES of them per step */
+    vera_program prog;
+    vera_batch vbatch;
+    uint32_t *registers = (uint32_t*)calloc(ctx.register_count, sizeof(uint32_t));
+    uint64_t firings = 0;
+    vera_program_init(&prog, &ctx);
+    vera_fill_registers(&ctx, registers);
+    vera_batch_init(&vbatch, &prog, BENCH_INSTANCES);
+    for(unsigned int i = 0; i < BENCH_INSTANCES; i++)
+        vera_batch_set(&vbatch, i, registers);
+    t = bench_now();
+    vera_batch_run(&vbatch, BENCH_LANES_FUEL);
+    elapsed = bench_now() - t;
+    for(unsigned int i = 0; i < BENCH_INSTANCES; i++)
+        firings += vbatch.firings[i];
+    printf("  lanes    %9.2f ms  %8.2f M/s      %llu firings, %u instances %u lanes at a time (%s)\n",
+           elapsed * 1e3, firings / 1e6 / elapsed, (unsigned long long)firings, BENCH_INSTANCES,
+           VERA_BATCH_LANES, VERA_BATCH_ISA);
+    vera_batch_free(&vbatch);
+    vera_program_free(&prog);
+    free(registers);
+
+    /* the same program as instances sharing their code, on one thread then on all of them */
+    char path[] = "/tmp/vera_benchXXXXXX";
+    uint8_t *image;
+    const size_t image_size = vera_riscv32_image(&ctx, &image);
+    int fd = mkstemp(path);
+    if(fd < 0 || write(fd, image, image_size) != image_size) {
+        fprintf(stderr, "can't write the image\n");
+        exit(1);
+    }
+    close(fd);
+    /* the code section alone, then the same program without the compressed instructions */
+    uint8_t *rvi_image;
+    ctx.rvc = 0;
+    vera_riscv32_image(&ctx, &rvi_image);
+    ctx.rvc = 1;
+    printf("  rvc      %9u bytes of code, %u without the compressed instructions\n",
+           ((vera_image_header*)image)->code_size, ((vera_image_header*)rvi_image)->code_size);
+    free(rvi_image);
+    const unsigned int thread_counts[2] = { 1, (unsigned int)sysconf(_SC_NPROCESSORS_ONLN) };
+    for(int k = 0; k < 2 && (k == 0 || thread_counts[k] > 1); k++) {
+        rv32_batch batch;
+        if(!rv32_batch_init(&batch, path, BENCH_INSTANCES, ram_size, thread_counts[k])) {
+            fprintf(stderr, "can't load the image\n");
+            exit(1);
+        }
+        for(unsigned int i = 0; i < BENCH_INSTANCES; i++)
+            batch.instances[i]->r[REG_A1] = BENCH_FUEL;
+        t = bench_now();
+        instructions = rv32_batch_run(&batch);
+        elapsed = bench_now() - t;
+        printf("  batch    %9.2f ms  %8.1f MIPS     %u instances on %u threads\n", elapsed * 1e3,
+               instructions / 1e6 / elapsed, BENCH_INSTANCES, thread_counts[k]);
+        rv32_batch_free(&batch);
+    }
+    unlink(path);
+    free(image);
+    printf("  peak RSS %9.1f MB\n", bench_peak_rss());
+
+    vera_free_ctx(&ctx);
+    for(unsigned int i = 0; i < config->port_count; i++)
+        free(port_names[i]);
+    free(port_names);
+    free(src.data);
+}
+
+/* Runs the built-in configurations from the smallest to the largest (the peak RSS is the one of
+   the process), or a single one given as : rules lhs rhs name_len noise ports */
+int main(int argc, char **argv) {
+    if(argc > 1) {
+        bench_config config = { 10000, 2, 2, 4, 0, 0 };
+        unsigned int *fields[] = { &config.rule_count, &config.lhs, &config.rhs,
+                                   &config.name_len, &config.noise, &config.port_count };
+        for(int i = 1; i < argc && i <= sizeof(fields) / sizeof(fields[0]); i++)
+            *fields[i - 1] = strtoul(argv[i], NULL, 10);
+        if(config.lhs == 0 || config.rhs == 0) {
+            fprintf(stderr, "lhs and rhs need at least one fact\n");
+            return 1;
+        }
+        bench_run(&config);
+        return 0;
+    }
+    for(size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+        bench_run(&configs[i]);
+    return 0;
+}
@@ -13,14 +13,55 @@ typedef enum {
   RV32_INVALID_MEMORY_ACCESS
 } rv32_status_t;
 
+/* Predecoded instruction, see rv32_attach_icache */
 typedef struct {
+  uint8_t op; /* RV32_OP_*, with RV32_OP_HALF for a compressed instruction */
+  uint8_t rd, rs1, rs2;
+  int32_t imm;
+} rv32_decoded;
+
+typedef enum {
+  RV32_MMIO_OK,
+  RV32_MMIO_ERR
+} rv32_mmio_result_t;
+
+typedef struct rv32 RV32;
+
+/* Handlers of a MMIO region, `offset` is relative to the base of the region and `user` is the
+   pointer given to rv32_map_mmio. An access with a NULL handler faults */
+typedef struct {
+  rv32_mmio_result_t (*load8)(void *user, uint32_t offset, uint8_t *ret);
+  rv32_mmio_result_t (*load16)(void *user, uint32_t offset, uint16_t *ret);
+  rv32_mmio_result_t (*load32)(void *user, uint32_t offset, uint32_t *ret);
+  rv32_mmio_result_t (*store8)(void *user, uint32_t offset, uint8_t val);
+  rv32_mmio_result_t (*store16)(void *user, uint32_t offset, uint16_t val);
+  rv32_mmio_result_t (*store32)(void *user, uint32_t offset, uint32_t val);
+} rv32_mmio_ops;
+
+typedef struct {
+  uint32_t base, size;
+  const rv32_mmio_ops *ops;
+  void *user;
+} rv32_mmio_region;
+
+#define RV32_MMIO_REGIONS 8
+
+struct rv32 {
   uint32_t mem_size;
   rv32_status_t status;
   uint8_t bp_mask; /* breakpoint enabled if bit enabled */
   uint32_t bp[8]; /* breakpoints */
   uint32_t r[32], pc;
+  rv32_decoded *icache;
+  uint32_t icache_limit; /* instructions below this address are cached */
+  uint8_t icache_shared; /* the code is read-only, see rv32_share_icache */
+  /* only the accesses outside of the RAM look for their region */
+  rv32_mmio_region mmio[RV32_MMIO_REGIONS];
+  uint8_t mmio_count;
+  void (*ecall)(RV32 *rv32); /* ignored if NULL */
+  void *user; /* for the ecall handler */
   uint8_t mem[1];
-} RV32;
+};
 
 enum rv32_register {
   REG_ZERO,
@@ -60,26 +101,63 @@ enum rv32_register {
 
 /* Gives the amount of memory needed for the RAM + the struct */
 #define RV32_NEEDED_MEMORY(bytes) (sizeof(RV32) + bytes)
+/* Offset of the RAM in the memory given to rv32_new, to page align the RAM */
+#define RV32_MEM_OFFSET offsetof(RV32, mem)
+/* Gives the amount of memory needed to cache the code below `code_size`, with an entry for
+   every 2 bytes since the compressed instructions (RVC) are 2 bytes aligned, and 2 sentinels */
+#define RV32_ICACHE_NEEDED_MEMORY(code_size)                                   \
+  ((((code_size) + 1) / 2 + 2) * sizeof(rv32_decoded))
 
 RV32 *rv32_new(void *memory, uint32_t mem_size);
 void rv32_resume(RV32 *rv32);
 void rv32_cycle(RV32 *rv32);
+void rv32_attach_icache(RV32 *rv32, void *memory, uint32_t code_size);
+void rv32_flush_icache(RV32 *rv32);
+void rv32_decode_icache(RV32 *rv32);
+void rv32_share_icache(RV32 *rv32, rv32_decoded *icache, uint32_t code_size);
+uint32_t rv32_run(RV32 *rv32, uint32_t max_instructions);
 int rv32_set_breakpoint(RV32*, uint32_t addr);
 int rv32_clear_breakpoint(RV32*, uint32_t addr);
-extern void ecall(RV32 *rv32);
+int rv32_map_mmio(RV32 *rv32, uint32_t base, uint32_t size, const rv32_mmio_ops *ops,
+                  void *user);
+int rv32_unmap_mmio(RV32 *rv32, uint32_t base);
+void rv32_set_ecall(RV32 *rv32, void (*ecall)(RV32 *rv32), void *user);
 
-typedef enum {
-  RV32_MMIO_OK,
-  RV32_MMIO_ERR
-} rv32_mmio_result_t;
+#define RV32_IMAGE_MAGIC 0x41524556u /* "VERA" */
+
+/* Start of the header of a program image (see vera_image_header in vera.h) : two sections,
+   loaded at their guest address. The rest of the header belongs to the producer */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t entry;
+  uint32_t code_offset, code_addr, code_size;
+  uint32_t data_offset, data_addr, data_size;
+} rv32_image_header;
+
+int rv32_load_image(RV32 *rv32, const char *path);
 
-rv32_mmio_result_t mmio_load8(uint32_t addr, uint8_t *ret);
-rv32_mmio_result_t mmio_load16(uint32_t addr, uint16_t *ret);
-rv32_mmio_result_t mmio_load32(uint32_t addr, uint32_t *ret);
+/* Instances of the same image, run over a pool of threads if RV32_THREADS is defined. The
+   threads live as long as the batch, and wait for the next rv32_batch_run between the runs.
+   The sections of every instance are mapped copy-on-write from the image, so that the code
+   pages stay shared, and the instances share one decoded cache of the code */
+typedef struct rv32_pool rv32_pool;
 
-rv32_mmio_result_t mmio_store8(uint32_t addr, uint8_t val);
-rv32_mmio_result_t mmio_store16(uint32_t addr, uint16_t val);
-rv32_mmio_result_t mmio_store32(uint32_t addr, uint32_t val);
+typedef struct {
+  unsigned int instance_count;
+  RV32 **instances; /* loaded and ready to run, the caller sets their inputs */
+  uint32_t *budgets; /* instructions per instance and per rv32_batch_run, 0 means no limit */
+  uint64_t *executed; /* per instance, by the last rv32_batch_run */
+  rv32_decoded *icache;
+  void *memory; /* of all the instances */
+  size_t memory_size;
+  rv32_pool *pool;
+} rv32_batch;
+
+int rv32_batch_init(rv32_batch *batch, const char *path, unsigned int instance_count,
+                    uint32_t mem_size, unsigned int thread_count);
+void rv32_batch_free(rv32_batch *batch);
+uint64_t rv32_batch_run(rv32_batch *batch);
 
 #ifdef RV32_IMPLEMENTATION
 
@@ -91,6 +169,15 @@ rv32_mmio_result_t mmio_store32(uint32_t addr, uint32_t val);
 #define trace(...)
 #endif
 
+#include <stdio.h>
+#include <stdlib.h>
+/* rv32_load_image maps the sections when it can */
+#if defined(__unix__) || defined(__APPLE__)
+#define RV32_IMAGE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #define SEXT(x, n) ((x) & (1 << (n - 1)) ? (x) | (0xFFFFFFFF << n) : (x))
 
 #define RD ((instr >> 7) & 0x1f)
@@ -155,6 +242,9 @@ rv32_mmio_result_t mmio_store32(uint32_t addr, uint32_t val);
 #error "Please define LITTLE_ENDIAN_HOST or BIG_ENDIAN_HOST macro"
 #endif
 
+/* with RVC the 4 bytes instructions are only 2 bytes aligned */
+#define FETCH32(addr) ((uint32_t)LOAD16(addr) | (uint32_t)LOAD16((addr) + 2) << 16)
+
 const char *rname[] = {"zero", "ra", "sp",  "gp",  "tp", "t0", "t1", "t2",
                        "s0",   "s1", "a0",  "a1",  "a2", "a3", "a4", "a5",
                        "a6",   "a7", "s2",  "s3",  "s4", "s5", "s6", "s7",
@@ -162,7 +252,19 @@ const char *rname[] = {"zero", "ra", "sp",  "gp",  "tp", "t0", "t1", "t2",
 
 RV32 *rv32_new(void *memory, uint32_t mem_size) {
   RV32 *rv32 = (RV32 *)memory;
+  int i;
   rv32->mem_size = mem_size;
+  rv32->status = RV32_RUNNING;
+  rv32->bp_mask = 0;
+  for (i = 0; i < 32; i++)
+    rv32->r[i] = 0;
+  rv32->pc = 0;
+  rv32->icache = NULL;
+  rv32->icache_limit = 0;
+  rv32->icache_shared = 0;
+  rv32->mmio_count = 0;
+  rv32->ecall = NULL;
+  rv32->user = NULL;
   return rv32;
 }
 
@@ -171,17 +273,196 @@ void rv32_resume(RV32 *rv32) {
     rv32->status = RV32_RUNNING;
 }
 
-void rv32_cycle(RV32 *rv32) {
-  uint32_t instr, addr;
-  uint8_t opcode, funct3, funct7;
+#define RV32_OPS(X)                                                            \
+  X(DECODE) X(EXIT) X(INVALID) X(LUI) X(AUIPC) X(JAL) X(JALR) X(BEQ) X(BNE)    \
+  X(BLT) X(BGE) X(BLTU) X(BGEU) X(LB) X(LH) X(LW) X(LBU) X(LHU) X(SB) X(SH)    \
+  X(SW) X(ADDI) X(SLTI) X(SLTIU) X(XORI) X(ORI) X(ANDI) X(SLLI) X(SRLI)        \
+  X(SRAI) X(ADD) X(SUB) X(SLL) X(SLT) X(SLTU) X(XOR) X(SRL) X(SRA) X(OR)       \
+  X(AND) X(MUL) X(MULH) X(MULHSU) X(MULHU) X(DIV) X(DIVU) X(REM) X(REMU)       \
+  X(ECALL) X(EBREAK)
+
+#define RV32_OP_ENUM(name) RV32_OP_##name,
+enum rv32_op { RV32_OPS(RV32_OP_ENUM) RV32_OP_COUNT };
+#undef RV32_OP_ENUM
+/* set in the op of the 2 bytes instructions, above every RV32_OP_* */
+#define RV32_OP_HALF 64
+typedef char rv32_op_half_check[RV32_OP_COUNT <= RV32_OP_HALF ? 1 : -1];
+
+/* A store changes the instructions starting from 2 bytes before it to its last byte */
+static void rv32_invalidate(RV32 *rv32, uint32_t addr) {
+  uint32_t i = addr >= 2 ? (addr - 2) >> 1 : 0, last = (addr + 3) >> 1;
+  const uint32_t n = rv32->icache_limit >> 1;
+  for (; i <= last && i < n; i++)
+    rv32->icache[i].op = RV32_OP_DECODE;
+}
+
+/* Slow path of the loads and stores outside of the RAM : `bytes` must fit in one region */
+static rv32_mmio_region *rv32_find_mmio(RV32 *rv32, uint32_t addr, uint32_t bytes) {
+  int i;
+  for (i = 0; i < rv32->mmio_count; i++) {
+    rv32_mmio_region *region = &rv32->mmio[i];
+    if (addr - region->base < region->size &&
+        region->size - (addr - region->base) >= bytes)
+      return region;
+  }
+  return NULL;
+}
+
+static int rv32_mmio_load(RV32 *rv32, uint32_t addr, uint32_t bytes, uint32_t *value) {
+  rv32_mmio_region *region = rv32_find_mmio(rv32, addr, bytes);
   uint8_t tmp8;
   uint16_t tmp16;
+  if (!region)
+    return 0;
+  addr -= region->base;
+  switch (bytes) {
+  case 1:
+    if (!region->ops->load8 || region->ops->load8(region->user, addr, &tmp8) != RV32_MMIO_OK)
+      return 0;
+    *value = tmp8;
+    return 1;
+  case 2:
+    if (!region->ops->load16 || region->ops->load16(region->user, addr, &tmp16) != RV32_MMIO_OK)
+      return 0;
+    *value = tmp16;
+    return 1;
+  default:
+    return region->ops->load32 &&
+           region->ops->load32(region->user, addr, value) == RV32_MMIO_OK;
+  }
+}
+
+static int rv32_mmio_store(RV32 *rv32, uint32_t addr, uint32_t bytes, uint32_t value) {
+  rv32_mmio_region *region = rv32_find_mmio(rv32, addr, bytes);
+  if (!region)
+    return 0;
+  addr -= region->base;
+  switch (bytes) {
+  case 1:
+    return region->ops->store8 &&
+           region->ops->store8(region->user, addr, value & 0xff) == RV32_MMIO_OK;
+  case 2:
+    return region->ops->store16 &&
+           region->ops->store16(region->user, addr, value & 0xffff) == RV32_MMIO_OK;
+  default:
+    return region->ops->store32 &&
+           region->ops->store32(region->user, addr, value) == RV32_MMIO_OK;
+  }
+}
+
+/* Encodings of the base instructions that the compressed ones expand to */
+#define RV32_ENC_I(opcode, funct3, rd, rs1, imm)                               \
+  ((opcode) | (rd) << 7 | (funct3) << 12 | (rs1) << 15 |                       \
+   ((uint32_t)(imm) & 0xfff) << 20)
+#define RV32_ENC_S(funct3, rs1, rs2, imm)                                      \
+  (0x23 | ((uint32_t)(imm) & 0x1f) << 7 | (funct3) << 12 | (rs1) << 15 |       \
+   (rs2) << 20 | ((uint32_t)(imm) >> 5 & 0x7f) << 25)
+#define RV32_ENC_B(funct3, rs1, rs2, imm)                                      \
+  (0x63 | ((uint32_t)(imm) >> 11 & 1) << 7 | ((uint32_t)(imm) >> 1 & 0xf) << 8 |\
+   (funct3) << 12 | (rs1) << 15 | (rs2) << 20 |                                \
+   ((uint32_t)(imm) >> 5 & 0x3f) << 25 | ((uint32_t)(imm) >> 12 & 1) << 31)
+#define RV32_ENC_J(rd, imm)                                                    \
+  (0x6f | (rd) << 7 | ((uint32_t)(imm) & 0xff000) |                            \
+   ((uint32_t)(imm) >> 11 & 1) << 20 | ((uint32_t)(imm) >> 1 & 0x3ff) << 21 |  \
+   ((uint32_t)(imm) >> 20 & 1) << 31)
+#define RV32_ENC_R(funct7, funct3, rd, rs1, rs2)                               \
+  (0x33 | (rd) << 7 | (funct3) << 12 | (rs1) << 15 | (rs2) << 20 |             \
+   (funct7) << 25)
+/* bits [hi:lo] of a compressed instruction, moved to bit `to` */
+#define CBITS(hi, lo, to) ((((uint32_t)c >> (lo)) & ((1u << ((hi) - (lo) + 1)) - 1)) << (to))
+
+/* Gives the 32 bits instruction a compressed one stands for, 0 (an invalid instruction) for
+   the reserved encodings and the ones of the extensions we don't have */
+static uint32_t rv32_expand(uint32_t c) {
+  const uint32_t funct3 = c >> 13 & 7, rd = c >> 7 & 0x1f, rs2 = c >> 2 & 0x1f;
+  const uint32_t rd_ = 8 + (c >> 7 & 7), rs2_ = 8 + (c >> 2 & 7); /* x8-x15 */
+  const int32_t imm6 = SEXT(CBITS(12, 12, 5) | CBITS(6, 2, 0), 6);
+  uint32_t imm;
+  switch ((c & 3) << 3 | funct3) {
+  case 0x00: /* c.addi4spn */
+    imm = CBITS(12, 11, 4) | CBITS(10, 7, 6) | CBITS(6, 6, 2) | CBITS(5, 5, 3);
+    return imm ? RV32_ENC_I(0x13, 0, rs2_, REG_SP, imm) : 0;
+  case 0x02: /* c.lw */
+    imm = CBITS(12, 10, 3) | CBITS(6, 6, 2) | CBITS(5, 5, 6);
+    return RV32_ENC_I(0x03, 2, rs2_, rd_, imm);
+  case 0x06: /* c.sw */
+    imm = CBITS(12, 10, 3) | CBITS(6, 6, 2) | CBITS(5, 5, 6);
+    return RV32_ENC_S(2, rd_, rs2_, imm);
+  case 0x08: /* c.addi, c.nop */
+    return RV32_ENC_I(0x13, 0, rd, rd, imm6);
+  case 0x09: /* c.jal */
+  case 0x0d: /* c.j */
+    imm = SEXT(CBITS(12, 12, 11) | CBITS(11, 11, 4) | CBITS(10, 9, 8) |
+               CBITS(8, 8, 10) | CBITS(7, 7, 6) | CBITS(6, 6, 7) |
+               CBITS(5, 3, 1) | CBITS(2, 2, 5), 12);
+    return RV32_ENC_J(funct3 == 1 ? REG_RA : REG_ZERO, imm);
+  case 0x0a: /* c.li */
+    return RV32_ENC_I(0x13, 0, rd, REG_ZERO, imm6);
+  case 0x0b:
+    if (rd == REG_SP) { /* c.addi16sp */
+      imm = SEXT(CBITS(12, 12, 9) | CBITS(6, 6, 4) | CBITS(5, 5, 6) |
+                 CBITS(4, 3, 7) | CBITS(2, 2, 5), 10);
+      return imm ? RV32_ENC_I(0x13, 0, REG_SP, REG_SP, imm) : 0;
+    }
+    /* c.lui */
+    return imm6 ? (0x37 | rd << 7 | ((uint32_t)imm6 & 0xfffff) << 12) : 0;
+  case 0x0c:
+    switch (c >> 10 & 3) {
+    case 0: /* c.srli */
+      return c & 0x1000 ? 0 : RV32_ENC_I(0x13, 5, rd_, rd_, rs2);
+    case 1: /* c.srai */
+      return c & 0x1000 ? 0 : RV32_ENC_I(0x13, 5, rd_, rd_, 0x400 | rs2);
+    case 2: /* c.andi */
+      return RV32_ENC_I(0x13, 7, rd_, rd_, imm6);
+    default:
+      if (c & 0x1000)
+        return 0;
+      switch (c >> 5 & 3) {
+      case 0: return RV32_ENC_R(0x20, 0, rd_, rd_, rs2_); /* c.sub */
+      case 1: return RV32_ENC_R(0, 4, rd_, rd_, rs2_); /* c.xor */
+      case 2: return RV32_ENC_R(0, 6, rd_, rd_, rs2_); /* c.or */
+      default: return RV32_ENC_R(0, 7, rd_, rd_, rs2_); /* c.and */
+      }
+    }
+  case 0x0e: /* c.beqz */
+  case 0x0f: /* c.bnez */
+    imm = SEXT(CBITS(12, 12, 8) | CBITS(11, 10, 3) | CBITS(6, 5, 6) |
+               CBITS(4, 3, 1) | CBITS(2, 2, 5), 9);
+    return RV32_ENC_B(funct3 & 1, rd_, REG_ZERO, imm);
+  case 0x10: /* c.slli */
+    return c & 0x1000 ? 0 : RV32_ENC_I(0x13, 1, rd, rd, rs2);
+  case 0x12: /* c.lwsp */
+    imm = CBITS(12, 12, 5) | CBITS(6, 4, 2) | CBITS(3, 2, 6);
+    return rd ? RV32_ENC_I(0x03, 2, rd, REG_SP, imm) : 0;
+  case 0x14:
+    if (!(c & 0x1000)) {
+      if (rs2) /* c.mv */
+        return RV32_ENC_R(0, 0, rd, REG_ZERO, rs2);
+      return rd ? RV32_ENC_I(0x67, 0, REG_ZERO, rd, 0) : 0; /* c.jr */
+    }
+    if (rs2) /* c.add */
+      return RV32_ENC_R(0, 0, rd, rd, rs2);
+    if (rd) /* c.jalr */
+      return RV32_ENC_I(0x67, 0, REG_RA, rd, 0);
+    return RV32_ENC_I(0x73, 0, 0, 0, 1); /* c.ebreak */
+  case 0x16: /* c.swsp */
+    imm = CBITS(12, 9, 2) | CBITS(8, 7, 6);
+    return RV32_ENC_S(2, REG_SP, rs2, imm);
+  default:
+    return 0;
+  }
+}
+#undef CBITS
+
+void rv32_cycle(RV32 *rv32) {
+  uint32_t instr, addr, size;
+  uint8_t opcode, funct3, funct7;
   uint32_t tmp32;
   int i;
 
   if(rv32->status != RV32_RUNNING)
     return;
-  if (rv32->pc >= rv32->mem_size) {
+  if (rv32->pc >= rv32->mem_size - 1 || (rv32->pc & 1)) {
     rv32->status = RV32_INVALID_MEMORY_ACCESS;
     return;
   }
@@ -193,7 +474,17 @@ void rv32_cycle(RV32 *rv32) {
       }
     }
   }
-  instr = LOAD32(rv32->pc);
+  instr = LOAD16(rv32->pc);
+  if ((instr & 3) != 3) {
+    instr = rv32_expand(instr);
+    size = 2;
+  } else if (rv32->pc < rv32->mem_size - 3) {
+    instr = FETCH32(rv32->pc);
+    size = 4;
+  } else {
+    rv32->status = RV32_INVALID_MEMORY_ACCESS;
+    return;
+  }
   opcode = instr & 0x7f;
   funct3 = (instr >> 12) & 0x7;
   funct7 = (instr >> 25) & 0x7f;
@@ -334,7 +625,7 @@ void rv32_cycle(RV32 *rv32) {
       }
       }
     }
-    rv32->pc += 4;
+    rv32->pc += size;
     break;
 
   case 0x13:
@@ -386,7 +677,7 @@ void rv32_cycle(RV32 *rv32) {
       rv32->status = RV32_INVALID_INSTRUCTION;
       return;
     }
-    rv32->pc += 4;
+    rv32->pc += size;
     break;
 
   case 0x3:
@@ -395,11 +686,11 @@ void rv32_cycle(RV32 *rv32) {
     case 0x0: /* lb */
       trace("lb %s, %d(%s)\t0x%08x\n", rname[RD], SEXT_IMM_I, rname[RS1], addr);
       if (addr >= rv32->mem_size) {
-        if(mmio_load8(addr, &tmp8) != RV32_MMIO_OK) {
+        if (!rv32_mmio_load(rv32, addr, 1, &tmp32)) {
           rv32->status = RV32_INVALID_MEMORY_ACCESS;
           return;
         }
-        rv32->r[RD] = SEXT(tmp8, 8);
+        rv32->r[RD] = SEXT(tmp32, 8);
       } else {
         rv32->r[RD] = SEXT(LOAD8(addr), 8);
       }
@@ -407,11 +698,11 @@ void rv32_cycle(RV32 *rv32) {
     case 0x1: /* lh */
       trace("lh %s, %d(%s)\t0x%08x\n", rname[RD], SEXT_IMM_I, rname[RS1], addr);
       if (addr >= rv32->mem_size - 1) {
-        if(mmio_load16(addr, &tmp16) != RV32_MMIO_OK) {
+        if (!rv32_mmio_load(rv32, addr, 2, &tmp32)) {
           rv32->status = RV32_INVALID_MEMORY_ACCESS;
           return;
         }
-        rv32->r[RD] = SEXT(tmp16, 16);
+        rv32->r[RD] = SEXT(tmp32, 16);
       } else {
         rv32->r[RD] = SEXT(LOAD16(addr), 16);
       }
@@ -419,7 +710,7 @@ void rv32_cycle(RV32 *rv32) {
     case 0x2: /* lw */
       trace("lw %s, %d(%s)\t0x%08x\n", rname[RD], SEXT_IMM_I, rname[RS1], addr);
       if (addr >= rv32->mem_size - 3) {
-        if(mmio_load32(addr, &tmp32) != RV32_MMIO_OK) {
+        if (!rv32_mmio_load(rv32, addr, 4, &tmp32)) {
           rv32->status = RV32_INVALID_MEMORY_ACCESS;
           return;
         }
@@ -431,11 +722,11 @@ void rv32_cycle(RV32 *rv32) {
     case 0x4: /* lbu */
       trace("lbu %s, %d(%s)\n", rname[RD], SEXT_IMM_I, rname[RS1]);
       if (addr >= rv32->mem_size) {
-        if(mmio_load8(addr, &tmp8) != RV32_MMIO_OK) {
+        if (!rv32_mmio_load(rv32, addr, 1, &tmp32)) {
           rv32->status = RV32_INVALID_MEMORY_ACCESS;
           return;
         }
-        rv32->r[RD] = tmp8;
+        rv32->r[RD] = tmp32;
       } else {
         rv32->r[RD] = LOAD8(addr);
       }
@@ -443,11 +734,11 @@ void rv32_cycle(RV32 *rv32) {
     case 0x5: /* lhu */
       trace("lhu %s, %d(%s)\n", rname[RD], SEXT_IMM_I, rname[RS1]);
       if (addr >= rv32->mem_size - 1) {
-        if(mmio_load16(addr, &tmp16) != RV32_MMIO_OK) {
+        if (!rv32_mmio_load(rv32, addr, 2, &tmp32)) {
           rv32->status = RV32_INVALID_MEMORY_ACCESS;
           return;
         }
-        rv32->r[RD] = tmp16;
+        rv32->r[RD] = tmp32;
       } else {
         rv32->r[RD] = LOAD16(addr);
       }
@@ -457,16 +748,23 @@ void rv32_cycle(RV32 *rv32) {
       rv32->status = RV32_INVALID_INSTRUCTION;
       return;
     }
-    rv32->pc += 4;
+    rv32->pc += size;
     break;
 
   case 0x23:
     addr = rv32->r[RS1] + SEXT_IMM_S;
+    if (addr < rv32->icache_limit) {
+      if (rv32->icache_shared) {
+        rv32->status = RV32_INVALID_MEMORY_ACCESS;
+        return;
+      }
+      rv32_invalidate(rv32, addr);
+    }
     switch (funct3) {
     case 0x0: /* sb */
       trace("sb %s, %d(%s)\t0x%08x\n", rname[RS2], SEXT_IMM_I, rname[RS1], addr);
       if (addr >= rv32->mem_size) {
-        if(mmio_store8(addr, rv32->r[RS2] & 0xff) != RV32_MMIO_OK) {
+        if (!rv32_mmio_store(rv32, addr, 1, rv32->r[RS2])) {
           rv32->status = RV32_INVALID_MEMORY_ACCESS;
           return;
         }
@@ -477,7 +775,7 @@ void rv32_cycle(RV32 *rv32) {
     case 0x1: /* sh */
       trace("sh %s, %d(%s)\t0x%08x\n", rname[RS2], SEXT_IMM_I, rname[RS1], addr);
       if (addr >= rv32->mem_size) {
-        if(mmio_store16(addr, rv32->r[RS2] & 0xffff) != RV32_MMIO_OK) {
+        if (!rv32_mmio_store(rv32, addr, 2, rv32->r[RS2])) {
           rv32->status = RV32_INVALID_MEMORY_ACCESS;
           return;
         }
@@ -488,7 +786,7 @@ void rv32_cycle(RV32 *rv32) {
     case 0x2: /* sw */
       trace("sw %s, %d(%s)\t0x%08x\n", rname[RS2], SEXT_IMM_I, rname[RS1], addr);
       if (addr >= rv32->mem_size - 3) {
-        if(mmio_store32(addr, rv32->r[RS2]) != RV32_MMIO_OK) {
+        if (!rv32_mmio_store(rv32, addr, 4, rv32->r[RS2])) {
           rv32->status = RV32_INVALID_MEMORY_ACCESS;
           return;
         }
@@ -501,7 +799,7 @@ void rv32_cycle(RV32 *rv32) {
       rv32->status = RV32_INVALID_INSTRUCTION;
       return;
     }
-    rv32->pc += 4;
+    rv32->pc += size;
     break;
 
   case 0x63:
@@ -511,41 +809,41 @@ void rv32_cycle(RV32 *rv32) {
       if (rv32->r[RS1] == rv32->r[RS2])
         rv32->pc += SEXT_IMM_B;
       else
-        rv32->pc += 4;
+        rv32->pc += size;
       break;
     case 0x1: /* bne */
       trace("bne %s, %s, %d\n", rname[RS1], rname[RS2], SEXT_IMM_B);
       if (rv32->r[RS1] != rv32->r[RS2])
         rv32->pc += SEXT_IMM_B;
       else
-        rv32->pc += 4;
+        rv32->pc += size;
       break;
     case 0x4: /* blt */
       if ((int32_t)rv32->r[RS1] < (int32_t)rv32->r[RS2])
         rv32->pc += SEXT_IMM_B;
       else
-        rv32->pc += 4;
+        rv32->pc += size;
       trace("blt %s, %s, %d\n", rname[RS1], rname[RS2], SEXT_IMM_B);
       break;
     case 0x5: /* bge */
       if ((int32_t)rv32->r[RS1] >= (int32_t)rv32->r[RS2])
         rv32->pc += SEXT_IMM_B;
       else
-        rv32->pc += 4;
+        rv32->pc += size;
       trace("bge %s, %s, %d\n", rname[RS1], rname[RS2], SEXT_IMM_B);
       break;
     case 0x6: /* bltu */
       if (rv32->r[RS1] < rv32->r[RS2])
         rv32->pc += SEXT_IMM_B;
       else
-        rv32->pc += 4;
+        rv32->pc += size;
       trace("bltu %s, %s, %d\n", rname[RS1], rname[RS2], SEXT_IMM_B);
       break;
     case 0x7: /* bgeu */
       if (rv32->r[RS1] >= rv32->r[RS2])
         rv32->pc += SEXT_IMM_B;
       else
-        rv32->pc += 4;
+        rv32->pc += size;
       trace("bgeu %s, %s, %d\n", rname[RS1], rname[RS2], SEXT_IMM_B);
       break;
     default:
@@ -557,33 +855,34 @@ void rv32_cycle(RV32 *rv32) {
 
   case 0x6f: /* jal */
     trace("jal %s, %d\n", rname[RD], SEXT_IMM_J);
-    rv32->r[RD] = rv32->pc + 4;
+    rv32->r[RD] = rv32->pc + size;
     rv32->pc += SEXT_IMM_J;
     break;
 
   case 0x67: /* jalr */
     trace("jalr %s, %s, %d\n", rname[RD], rname[RS1], SEXT_IMM_I);
-    rv32->r[RD] = rv32->pc + 4;
+    rv32->r[RD] = rv32->pc + size;
     rv32->pc = rv32->r[RS1] + SEXT_IMM_I;
     break;
 
   case 0x37: /* lui */
     trace("lui %s, %d\n", rname[RD], SEXT_IMM_U);
     rv32->r[RD] = SEXT_IMM_U << 12;
-    rv32->pc += 4;
+    rv32->pc += size;
     break;
 
   case 0x17: /* auipc */
     trace("auipc %s, %d\n", rname[RD], SEXT_IMM_U);
     rv32->r[RD] = rv32->pc + (SEXT_IMM_U << 12);
-    rv32->pc += 4;
+    rv32->pc += size;
     break;
 
   case 0x73: /* ecall */
     switch (IMM_I) {
     case 0x0: /* ecall */
       trace("ecall %d\n", rv32->r[17]);
-      ecall(rv32);
+      if (rv32->ecall)
+        rv32->ecall(rv32);
       if(rv32->status != RV32_RUNNING)
         return;
       break;
@@ -596,7 +895,7 @@ void rv32_cycle(RV32 *rv32) {
       rv32->status = RV32_INVALID_INSTRUCTION;
       return;
     }
-    rv32->pc += 4;
+    rv32->pc += size;
     break;
   default:
     trace("invalid opcode\n");
@@ -605,6 +904,490 @@ void rv32_cycle(RV32 *rv32) {
   }
 }
 
+void rv32_attach_icache(RV32 *rv32, void *memory, uint32_t code_size) {
+  rv32->icache = (rv32_decoded *)memory;
+  rv32->icache_limit = (code_size + 1) & ~1u;
+  rv32->icache_shared = 0;
+  rv32_flush_icache(rv32);
+}
+
+/* Must be called when the cached code is modified by the host */
+void rv32_flush_icache(RV32 *rv32) {
+  uint32_t i, n = rv32->icache_limit / 2;
+  if (rv32->icache_shared)
+    return;
+  for (i = 0; i < n; i++)
+    rv32->icache[i].op = RV32_OP_DECODE;
+  /* sentinels, so that running past the end of the cache needs no check : a 4 bytes instruction
+     in the last entry skips the first one */
+  rv32->icache[n].op = RV32_OP_EXIT;
+  rv32->icache[n + 1].op = RV32_OP_EXIT;
+}
+
+static void rv32_decode(uint32_t instr, rv32_decoded *d) {
+  uint8_t opcode = instr & 0x7f, funct3 = (instr >> 12) & 0x7,
+          funct7 = (instr >> 25) & 0x7f;
+  /* writes to zero go to a scratch register */
+  d->rd = RD ? RD : 32;
+  d->rs1 = RS1;
+  d->rs2 = RS2;
+  d->imm = 0;
+  d->op = RV32_OP_INVALID;
+  switch (opcode) {
+  case 0x33:
+    if (funct7 == 0x01) {
+      static const uint8_t ops[8] = {RV32_OP_MUL,  RV32_OP_MULH, RV32_OP_MULHSU,
+                                     RV32_OP_MULHU, RV32_OP_DIV,  RV32_OP_DIVU,
+                                     RV32_OP_REM,  RV32_OP_REMU};
+      d->op = ops[funct3];
+    } else if (funct7 == 0x00) {
+      static const uint8_t ops[8] = {RV32_OP_ADD, RV32_OP_SLL, RV32_OP_SLT,
+                                     RV32_OP_SLTU, RV32_OP_XOR, RV32_OP_SRL,
+                                     RV32_OP_OR,  RV32_OP_AND};
+      d->op = ops[funct3];
+    } else if (funct7 == 0x20 && funct3 == 0x0) {
+      d->op = RV32_OP_SUB;
+    } else if (funct7 == 0x20 && funct3 == 0x5) {
+      d->op = RV32_OP_SRA;
+    }
+    break;
+  case 0x13:
+    d->imm = SEXT_IMM_I;
+    switch (funct3) {
+    case 0x0: d->op = RV32_OP_ADDI; break;
+    case 0x2: d->op = RV32_OP_SLTI; break;
+    case 0x3: d->op = RV32_OP_SLTIU; d->imm = IMM_I; break;
+    case 0x4: d->op = RV32_OP_XORI; break;
+    case 0x6: d->op = RV32_OP_ORI; break;
+    case 0x7: d->op = RV32_OP_ANDI; break;
+    case 0x1: d->op = RV32_OP_SLLI; d->imm = IMM_I & 0x1f; break;
+    case 0x5:
+      d->imm = IMM_I & 0x1f;
+      if (funct7 == 0x00)
+        d->op = RV32_OP_SRLI;
+      else if (funct7 == 0x20)
+        d->op = RV32_OP_SRAI;
+      break;
+    }
+    break;
+  case 0x3:
+    d->imm = SEXT_IMM_I;
+    switch (funct3) {
+    case 0x0: d->op = RV32_OP_LB; break;
+    case 0x1: d->op = RV32_OP_LH; break;
+    case 0x2: d->op = RV32_OP_LW; break;
+    case 0x4: d->op = RV32_OP_LBU; break;
+    case 0x5: d->op = RV32_OP_LHU; break;
+    }
+    break;
+  case 0x23:
+    d->imm = SEXT_IMM_S;
+    switch (funct3) {
+    case 0x0: d->op = RV32_OP_SB; break;
+    case 0x1: d->op = RV32_OP_SH; break;
+    case 0x2: d->op = RV32_OP_SW; break;
+    }
+    break;
+  case 0x63:
+    d->imm = SEXT_IMM_B;
+    switch (funct3) {
+    case 0x0: d->op = RV32_OP_BEQ; break;
+    case 0x1: d->op = RV32_OP_BNE; break;
+    case 0x4: d->op = RV32_OP_BLT; break;
+    case 0x5: d->op = RV32_OP_BGE; break;
+    case 0x6: d->op = RV32_OP_BLTU; break;
+    case 0x7: d->op = RV32_OP_BGEU; break;
+    }
+    break;
+  case 0x6f:
+    d->op = RV32_OP_JAL;
+    d->imm = SEXT_IMM_J;
+    break;
+  case 0x67:
+    d->op = RV32_OP_JALR;
+    d->imm = SEXT_IMM_I;
+    break;
+  case 0x37:
+    d->op = RV32_OP_LUI;
+    d->imm = SEXT_IMM_U << 12;
+    break;
+  case 0x17:
+    d->op = RV32_OP_AUIPC;
+    d->imm = SEXT_IMM_U << 12;
+    break;
+  case 0x73:
+    if (IMM_I == 0x0)
+      d->op = RV32_OP_ECALL;
+    else if (IMM_I == 0x1)
+      d->op = RV32_OP_EBREAK;
+    break;
+  }
+}
+
+/* Decodes the instruction at `addr`, compressed or not */
+static void rv32_decode_at(RV32 *rv32, uint32_t addr, rv32_decoded *d) {
+  const uint32_t instr = LOAD16(addr);
+  if ((instr & 3) != 3) {
+    rv32_decode(rv32_expand(instr), d);
+    d->op |= RV32_OP_HALF;
+  } else if (addr < rv32->mem_size - 3) {
+    rv32_decode(FETCH32(addr), d);
+  } else {
+    d->op = RV32_OP_INVALID;
+  }
+}
+
+/* Decodes the whole attached cache at once, instead of on the first run of every instruction */
+void rv32_decode_icache(RV32 *rv32) {
+  uint32_t i, n = rv32->icache_limit / 2;
+  for (i = 0; i < n; i++)
+    rv32_decode_at(rv32, 2 * i, &rv32->icache[i]);
+}
+
+/* Attaches a cache decoded by rv32_decode_icache from the same code, and never written again :
+   it can be shared by instances running on different threads. The code is then read-only, a
+   store below `code_size` faults */
+void rv32_share_icache(RV32 *rv32, rv32_decoded *icache, uint32_t code_size) {
+  rv32->icache = icache;
+  rv32->icache_limit = (code_size + 1) & ~1u;
+  rv32->icache_shared = 1;
+}
+
+#if defined(__GNUC__) && !defined(RV32_NO_THREADED_CODE)
+#define RV32_THREADED_CODE
+#endif
+
+#ifdef RV32_THREADED_CODE
+/* labels as values are a GNU extension */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define HANDLER(name) op_##name:
+#define DISPATCH() goto *handlers[d->op]
+#else
+#define HANDLER(name) case RV32_OP_##name:
+#define DISPATCH() goto dispatch
+#endif
+
+/* one entry of the cache for every 2 bytes */
+#define PC ((uint32_t)(d - icache) << 1)
+#define SIZE (4 - (d->op >> 5 & 2))
+#define NEXT()                                                                 \
+  do {                                                                         \
+    d += 2 - (d->op >> 6);                                                     \
+    executed++;                                                                \
+    DISPATCH();                                                                \
+  } while (0)
+/* branches end the basic blocks, the budget is only checked there */
+#define JUMP(target)                                                           \
+  do {                                                                         \
+    pc = (target);                                                             \
+    if (pc >= limit || (pc & 1) || executed >= budget)                         \
+      goto leave;                                                              \
+    d = &icache[pc >> 1];                                                      \
+    executed++;                                                                \
+    DISPATCH();                                                                \
+  } while (0)
+#define BRANCH(cond)                                                           \
+  do {                                                                         \
+    if (cond)                                                                  \
+      JUMP(PC + d->imm);                                                       \
+    NEXT();                                                                    \
+  } while (0)
+#define FAULT(st)                                                              \
+  do {                                                                         \
+    rv32->status = st;                                                         \
+    pc = PC;                                                                   \
+    executed--;                                                                \
+    goto leave;                                                                \
+  } while (0)
+#define LOAD(type, size, conv)                                                 \
+  do {                                                                         \
+    addr = x[d->rs1] + d->imm;                                                 \
+    if (addr >= mem_size - (size / 8 - 1)) {                                   \
+      uint32_t tmp;                                                            \
+      if (!rv32_mmio_load(rv32, addr, size / 8, &tmp))                         \
+        FAULT(RV32_INVALID_MEMORY_ACCESS);                                     \
+      x[d->rd] = conv((type)tmp);                                              \
+    } else {                                                                   \
+      x[d->rd] = conv(LOAD##size(addr));                                       \
+    }                                                                          \
+    NEXT();                                                                    \
+  } while (0)
+#define STORE(size, mask)                                                      \
+  do {                                                                         \
+    addr = x[d->rs1] + d->imm;                                                 \
+    if (addr >= mem_size - (size / 8 - 1)) {                                   \
+      if (!rv32_mmio_store(rv32, addr, size / 8, x[d->rs2]))                   \
+        FAULT(RV32_INVALID_MEMORY_ACCESS);                                     \
+    } else {                                                                   \
+      if (addr < limit) {                                                      \
+        if (rv32->icache_shared)                                               \
+          FAULT(RV32_INVALID_MEMORY_ACCESS);                                   \
+        rv32_invalidate(rv32, addr);                                           \
+      }                                                                        \
+      STORE##size(addr, x[d->rs2] & mask);                                     \
+    }                                                                          \
+    NEXT();                                                                    \
+  } while (0)
+#define SEXT8(v) SEXT((uint32_t)(v), 8)
+#define SEXT16(v) SEXT((uint32_t)(v), 16)
+#define ZEXT(v) ((uint32_t)(v))
+
+/* Runs the cached code from rv32->pc, until it leaves the cache, stops, or
+   runs at least `budget` instructions. Returns the number of instructions */
+static uint32_t rv32_run_cached(RV32 *rv32, uint32_t budget) {
+#ifdef RV32_THREADED_CODE
+#define RV32_OP_LABEL(name)                                                    \
+  [RV32_OP_##name] = &&op_##name, [RV32_OP_HALF + RV32_OP_##name] = &&op_##name,
+  static const void *const handlers[2 * RV32_OP_HALF] = {RV32_OPS(RV32_OP_LABEL)};
+#undef RV32_OP_LABEL
+#endif
+  rv32_decoded *const icache = rv32->icache, *d;
+  const uint32_t limit = rv32->icache_limit, mem_size = rv32->mem_size;
+  uint32_t x[33], pc, addr, executed = 1;
+  int i;
+
+  for (i = 0; i < 32; i++)
+    x[i] = rv32->r[i];
+  x[0] = 0;
+  d = &icache[rv32->pc >> 1];
+
+#ifdef RV32_THREADED_CODE
+  DISPATCH();
+#else
+dispatch:
+  switch (d->op & (RV32_OP_HALF - 1)) {
+#endif
+  HANDLER(DECODE) {
+    rv32_decode_at(rv32, PC, d);
+    DISPATCH();
+  }
+  HANDLER(EXIT) {
+    pc = PC;
+    executed--;
+    goto leave;
+  }
+  HANDLER(INVALID) FAULT(RV32_INVALID_INSTRUCTION);
+  HANDLER(LUI) {
+    x[d->rd] = d->imm;
+    NEXT();
+  }
+  HANDLER(AUIPC) {
+    x[d->rd] = PC + d->imm;
+    NEXT();
+  }
+  HANDLER(JAL) {
+    pc = PC;
+    x[d->rd] = pc + SIZE;
+    JUMP(pc + d->imm);
+  }
+  HANDLER(JALR) {
+    pc = x[d->rs1] + d->imm;
+    x[d->rd] = PC + SIZE;
+    JUMP(pc);
+  }
+  HANDLER(BEQ) BRANCH(x[d->rs1] == x[d->rs2]);
+  HANDLER(BNE) BRANCH(x[d->rs1] != x[d->rs2]);
+  HANDLER(BLT) BRANCH((int32_t)x[d->rs1] < (int32_t)x[d->rs2]);
+  HANDLER(BGE) BRANCH((int32_t)x[d->rs1] >= (int32_t)x[d->rs2]);
+  HANDLER(BLTU) BRANCH(x[d->rs1] < x[d->rs2]);
+  HANDLER(BGEU) BRANCH(x[d->rs1] >= x[d->rs2]);
+  HANDLER(LB) LOAD(uint8_t, 8, SEXT8);
+  HANDLER(LH) LOAD(uint16_t, 16, SEXT16);
+  HANDLER(LW) LOAD(uint32_t, 32, ZEXT);
+  HANDLER(LBU) LOAD(uint8_t, 8, ZEXT);
+  HANDLER(LHU) LOAD(uint16_t, 16, ZEXT);
+  HANDLER(SB) STORE(8, 0xff);
+  HANDLER(SH) STORE(16, 0xffff);
+  HANDLER(SW) STORE(32, 0xffffffff);
+  HANDLER(ADDI) {
+    x[d->rd] = x[d->rs1] + d->imm;
+    NEXT();
+  }
+  HANDLER(SLTI) {
+    x[d->rd] = (int32_t)x[d->rs1] < d->imm ? 1 : 0;
+    NEXT();
+  }
+  HANDLER(SLTIU) {
+    x[d->rd] = x[d->rs1] < (uint32_t)d->imm ? 1 : 0;
+    NEXT();
+  }
+  HANDLER(XORI) {
+    x[d->rd] = x[d->rs1] ^ d->imm;
+    NEXT();
+  }
+  HANDLER(ORI) {
+    x[d->rd] = x[d->rs1] | d->imm;
+    NEXT();
+  }
+  HANDLER(ANDI) {
+    x[d->rd] = x[d->rs1] & d->imm;
+    NEXT();
+  }
+  HANDLER(SLLI) {
+    x[d->rd] = x[d->rs1] << d->imm;
+    NEXT();
+  }
+  HANDLER(SRLI) {
+    x[d->rd] = x[d->rs1] >> d->imm;
+    NEXT();
+  }
+  HANDLER(SRAI) {
+    x[d->rd] = (int32_t)x[d->rs1] >> d->imm;
+    NEXT();
+  }
+  HANDLER(ADD) {
+    x[d->rd] = x[d->rs1] + x[d->rs2];
+    NEXT();
+  }
+  HANDLER(SUB) {
+    x[d->rd] = x[d->rs1] - x[d->rs2];
+    NEXT();
+  }
+  HANDLER(SLL) {
+    x[d->rd] = x[d->rs1] << (x[d->rs2] & 0x1f);
+    NEXT();
+  }
+  HANDLER(SLT) {
+    x[d->rd] = (int32_t)x[d->rs1] < (int32_t)x[d->rs2] ? 1 : 0;
+    NEXT();
+  }
+  HANDLER(SLTU) {
+    x[d->rd] = x[d->rs1] < x[d->rs2] ? 1 : 0;
+    NEXT();
+  }
+  HANDLER(XOR) {
+    x[d->rd] = x[d->rs1] ^ x[d->rs2];
+    NEXT();
+  }
+  HANDLER(SRL) {
+    x[d->rd] = x[d->rs1] >> (x[d->rs2] & 0x1f);
+    NEXT();
+  }
+  HANDLER(SRA) {
+    x[d->rd] = (int32_t)x[d->rs1] >> (x[d->rs2] & 0x1f);
+    NEXT();
+  }
+  HANDLER(OR) {
+    x[d->rd] = x[d->rs1] | x[d->rs2];
+    NEXT();
+  }
+  HANDLER(AND) {
+    x[d->rd] = x[d->rs1] & x[d->rs2];
+    NEXT();
+  }
+  HANDLER(MUL) {
+    x[d->rd] = (((int64_t)x[d->rs1] * (int64_t)x[d->rs2]) & 0xFFFFFFFF);
+    NEXT();
+  }
+  HANDLER(MULH) {
+    x[d->rd] = ((int64_t)(int32_t)x[d->rs1] * (int64_t)(int32_t)x[d->rs2]) >> 32;
+    NEXT();
+  }
+  HANDLER(MULHSU) {
+    x[d->rd] = ((int64_t)(int32_t)x[d->rs1] * (int64_t)x[d->rs2]) >> 32;
+    NEXT();
+  }
+  HANDLER(MULHU) {
+    x[d->rd] = ((uint64_t)x[d->rs1] * (uint64_t)x[d->rs2]) >> 32;
+    NEXT();
+  }
+  HANDLER(DIV) {
+    int32_t dividend = x[d->rs1], divisor = x[d->rs2];
+    if (divisor == 0)
+      x[d->rd] = 0xFFFFFFFF;
+    else if (dividend == (int32_t)0x80000000 && divisor == -1)
+      x[d->rd] = dividend; /* overflow */
+    else
+      x[d->rd] = dividend / divisor;
+    NEXT();
+  }
+  HANDLER(DIVU) {
+    uint32_t dividend = x[d->rs1], divisor = x[d->rs2];
+    x[d->rd] = divisor == 0 ? 0xFFFFFFFF : dividend / divisor;
+    NEXT();
+  }
+  HANDLER(REM) {
+    int32_t dividend = x[d->rs1], divisor = x[d->rs2];
+    if (divisor == 0)
+      x[d->rd] = dividend;
+    else if (dividend == (int32_t)0x80000000 && divisor == -1)
+      x[d->rd] = 0; /* overflow */
+    else
+      x[d->rd] = dividend % divisor;
+    NEXT();
+  }
+  HANDLER(REMU) {
+    uint32_t dividend = x[d->rs1], divisor = x[d->rs2];
+    x[d->rd] = divisor == 0 ? dividend : dividend % divisor;
+    NEXT();
+  }
+  HANDLER(ECALL) {
+    for (i = 1; i < 32; i++)
+      rv32->r[i] = x[i];
+    rv32->pc = PC;
+    if (rv32->ecall)
+      rv32->ecall(rv32);
+    for (i = 1; i < 32; i++)
+      x[i] = rv32->r[i];
+    if (rv32->status != RV32_RUNNING) {
+      pc = rv32->pc;
+      goto leave;
+    }
+    JUMP(rv32->pc + SIZE);
+  }
+  HANDLER(EBREAK) {
+    rv32->status = RV32_EBREAK;
+    pc = PC;
+    goto leave;
+  }
+#ifndef RV32_THREADED_CODE
+  }
+#endif
+
+leave:
+  for (i = 1; i < 32; i++)
+    rv32->r[i] = x[i];
+  rv32->pc = pc;
+  return executed;
+}
+
+#ifdef RV32_THREADED_CODE
+#pragma GCC diagnostic pop
+#endif
+#undef HANDLER
+#undef DISPATCH
+#undef PC
+#undef NEXT
+#undef JUMP
+#undef SIZE
+#undef BRANCH
+#undef FAULT
+#undef LOAD
+#undef STORE
+#undef SEXT8
+#undef SEXT16
+#undef ZEXT
+
+/* Runs about `max_instructions` instructions (the cached code only checks the
+   budget at the end of the basic blocks) or until the status isn't
+   RV32_RUNNING. The cached code is used when an icache is attached and no
+   breakpoint is set, it doesn't trace. Returns the number of instructions */
+uint32_t rv32_run(RV32 *rv32, uint32_t max_instructions) {
+  uint32_t executed = 0;
+  while (rv32->status == RV32_RUNNING && executed < max_instructions) {
+    if (rv32->icache && !rv32->bp_mask && rv32->pc < rv32->icache_limit &&
+        !(rv32->pc & 1)) {
+      executed += rv32_run_cached(rv32, max_instructions - executed);
+    } else {
+      rv32_cycle(rv32);
+      if (rv32->status == RV32_RUNNING || rv32->status == RV32_EBREAK)
+        executed++;
+    }
+  }
+  return executed;
+}
+
 int rv32_set_breakpoint(RV32 *rv32, uint32_t addr) {
   int i;
   for(i = 0; i < 8; i++) {
@@ -629,5 +1412,383 @@ int rv32_clear_breakpoint(RV32 *rv32, uint32_t addr) {
   return 0;
 }
 
+/* Maps the accesses to [base, base + size) to `ops`, only outside of the RAM. Returns 0 if the
+   region overlaps another one or if there are already RV32_MMIO_REGIONS regions */
+int rv32_map_mmio(RV32 *rv32, uint32_t base, uint32_t size, const rv32_mmio_ops *ops,
+                  void *user) {
+  int i;
+  if (size == 0 || base + (size - 1) < base || rv32->mmio_count == RV32_MMIO_REGIONS)
+    return 0;
+  for (i = 0; i < rv32->mmio_count; i++) {
+    if (base - rv32->mmio[i].base < rv32->mmio[i].size ||
+        rv32->mmio[i].base - base < size)
+      return 0;
+  }
+  rv32->mmio[i].base = base;
+  rv32->mmio[i].size = size;
+  rv32->mmio[i].ops = ops;
+  rv32->mmio[i].user = user;
+  rv32->mmio_count++;
+  return 1;
+}
+
+int rv32_unmap_mmio(RV32 *rv32, uint32_t base) {
+  int i;
+  for (i = 0; i < rv32->mmio_count; i++) {
+    if (rv32->mmio[i].base == base) {
+      rv32->mmio[i] = rv32->mmio[--rv32->mmio_count];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void rv32_set_ecall(RV32 *rv32, void (*ecall)(RV32 *rv32), void *user) {
+  rv32->ecall = ecall;
+  rv32->user = user;
+}
+
+/* Reads `size` bytes at `offset` of the file into the guest memory at `addr`. The pages are
+   mapped copy-on-write instead when `addr` is page aligned in the host memory */
+static int rv32_load_section(RV32 *rv32, FILE *f, uint32_t offset, uint32_t addr,
+                             uint32_t size) {
+#ifdef RV32_IMAGE_MMAP
+  const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  const uintptr_t length = (size + page - 1) & ~(page - 1);
+#endif
+  if (size == 0)
+    return 1;
+  if (addr > rv32->mem_size || size > rv32->mem_size - addr)
+    return 0;
+#ifdef RV32_IMAGE_MMAP
+  if (((uintptr_t)(rv32->mem + addr) & (page - 1)) == 0 &&
+      (offset & (page - 1)) == 0 && length <= rv32->mem_size - addr &&
+      mmap(rv32->mem + addr, length, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, fileno(f), offset) != MAP_FAILED)
+    return 1;
+#endif
+  return fseek(f, offset, SEEK_SET) == 0 &&
+         fread(rv32->mem + addr, size, 1, f) == 1;
+}
+
+/* Reads the header of an image and checks that its sections are in the file */
+static int rv32_read_image_header(FILE *f, rv32_image_header *header) {
+  long file_size;
+  if (fread(header, sizeof(*header), 1, f) != 1 ||
+      header->magic != RV32_IMAGE_MAGIC || fseek(f, 0, SEEK_END) != 0)
+    return 0;
+  file_size = ftell(f);
+  return file_size >= 0 &&
+         (uint64_t)header->code_offset + header->code_size <= (uint64_t)file_size &&
+         (uint64_t)header->data_offset + header->data_size <= (uint64_t)file_size;
+}
+
+static int rv32_load_sections(RV32 *rv32, FILE *f, const rv32_image_header *header) {
+  if (!rv32_load_section(rv32, f, header->code_offset, header->code_addr,
+                         header->code_size) ||
+      !rv32_load_section(rv32, f, header->data_offset, header->data_addr,
+                         header->data_size))
+    return 0;
+  rv32->pc = header->entry;
+  rv32->status = RV32_RUNNING;
+  if (rv32->icache)
+    rv32_flush_icache(rv32);
+  return 1;
+}
+
+/* Loads the code and data sections of an image and points the pc to its entry. The rest of
+   the memory and the registers are left as is. Returns 1 on success */
+int rv32_load_image(RV32 *rv32, const char *path) {
+  rv32_image_header header;
+  int loaded;
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return 0;
+  loaded = rv32_read_image_header(f, &header) && rv32_load_sections(rv32, f, &header);
+  fclose(f);
+  return loaded;
+}
+
+#ifdef RV32_IMAGE_MMAP
+#define RV32_PAGE_SIZE ((size_t)sysconf(_SC_PAGESIZE))
+#else
+#define RV32_PAGE_SIZE ((size_t)1)
+#endif
+#define RV32_PAGE_ALIGN(size) (((size) + RV32_PAGE_SIZE - 1) & ~(RV32_PAGE_SIZE - 1))
+
+/* The instances are split in a range per thread. A thread takes the instances of its range
+   one by one, then steals the remaining ones of the other ranges the same way */
+typedef struct rv32_worker {
+  rv32_batch *batch;
+  unsigned int next, end; /* of the range, `next` goes past `end` once it is empty */
+  unsigned int worker;
+  rv32_pool *pool;
+  uint64_t executed;
+} rv32_worker;
+
+#ifdef RV32_THREADS
+#include <pthread.h>
+#define RV32_TAKE(worker) __atomic_fetch_add(&(worker)->next, 1, __ATOMIC_RELAXED)
+#else
+#define RV32_TAKE(worker) ((worker)->next++)
+#endif
+
+/* The calling thread of rv32_batch_run is the first worker, the others have their thread */
+struct rv32_pool {
+  unsigned int worker_count;
+  rv32_worker *workers;
+#ifdef RV32_THREADS
+  pthread_t *threads;
+  unsigned int started; /* the ranges of the threads that didn't start are stolen */
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  unsigned int run; /* incremented by every rv32_batch_run */
+  unsigned int busy; /* threads still in the current run */
+  int quit;
+#endif
+};
+
+static void rv32_batch_instance(rv32_batch *batch, unsigned int i) {
+  RV32 *rv32 = batch->instances[i];
+  uint64_t executed = 0;
+  if (batch->budgets[i]) {
+    executed = rv32_run(rv32, batch->budgets[i]);
+  } else {
+    while (rv32->status == RV32_RUNNING)
+      executed += rv32_run(rv32, 1u << 24);
+  }
+  batch->executed[i] = executed;
+}
+
+static void rv32_worker_run(rv32_worker *self) {
+  rv32_pool *pool = self->pool;
+  unsigned int k, i;
+  for (k = 0; k < pool->worker_count; k++) {
+    rv32_worker *victim = &pool->workers[(self->worker + k) % pool->worker_count];
+    while ((i = RV32_TAKE(victim)) < victim->end) {
+      rv32_batch_instance(self->batch, i);
+      self->executed += self->batch->executed[i];
+    }
+  }
+}
+
+#ifdef RV32_THREADS
+static void *rv32_worker_thread(void *arg) {
+  rv32_worker *self = (rv32_worker *)arg;
+  rv32_pool *pool = self->pool;
+  unsigned int run = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->run == run && !pool->quit)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->quit)
+      break;
+    run = pool->run;
+    pthread_mutex_unlock(&pool->lock);
+    rv32_worker_run(self);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+#endif
+
+static void rv32_pool_free(rv32_pool *pool) {
+#ifdef RV32_THREADS
+  unsigned int t;
+  if (pool->threads) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (t = 1; t < pool->started; t++)
+      pthread_join(pool->threads[t], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+  }
+#endif
+  free(pool->workers);
+  free(pool);
+}
+
+static rv32_pool *rv32_pool_new(rv32_batch *batch, unsigned int thread_count) {
+  rv32_pool *pool = (rv32_pool *)malloc(sizeof(rv32_pool));
+  unsigned int t;
+  if (thread_count > batch->instance_count)
+    thread_count = batch->instance_count;
+#ifndef RV32_THREADS
+  thread_count = 1;
+#endif
+  if (thread_count == 0)
+    thread_count = 1;
+  if (!pool)
+    return NULL;
+  pool->worker_count = thread_count;
+  pool->workers = (rv32_worker *)malloc(thread_count * sizeof(rv32_worker));
+#ifdef RV32_THREADS
+  pool->threads = NULL;
+#endif
+  if (!pool->workers) {
+    rv32_pool_free(pool);
+    return NULL;
+  }
+  for (t = 0; t < thread_count; t++) {
+    pool->workers[t].batch = batch;
+    pool->workers[t].next = pool->workers[t].end = 0;
+    pool->workers[t].worker = t;
+    pool->workers[t].pool = pool;
+    pool->workers[t].executed = 0;
+  }
+#ifdef RV32_THREADS
+  if (thread_count > 1) {
+    pool->threads = (pthread_t *)malloc(thread_count * sizeof(pthread_t));
+    if (!pool->threads) {
+      rv32_pool_free(pool);
+      return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->run = 0;
+    pool->busy = 0;
+    pool->quit = 0;
+    pool->started = 1;
+    while (pool->started < thread_count &&
+           pthread_create(&pool->threads[pool->started], NULL, rv32_worker_thread,
+                          &pool->workers[pool->started]) == 0)
+      pool->started++;
+  }
+#endif
+  return pool;
+}
+
+/* Loads `instance_count` instances of the image with `mem_size` bytes of RAM each, and starts
+   `thread_count` - 1 threads to run them with the calling one. The RAM of every instance is
+   page aligned, for the sections to be mapped. Returns 0 on failure */
+int rv32_batch_init(rv32_batch *batch, const char *path, unsigned int instance_count,
+                    uint32_t mem_size, unsigned int thread_count) {
+  const size_t header_size = RV32_PAGE_ALIGN(RV32_MEM_OFFSET);
+  const size_t instance_size = header_size + RV32_PAGE_ALIGN((size_t)mem_size);
+  rv32_image_header header;
+  unsigned int i;
+  FILE *f = fopen(path, "rb");
+  batch->instance_count = 0;
+  batch->memory = NULL;
+  batch->instances = NULL;
+  batch->budgets = NULL;
+  batch->executed = NULL;
+  batch->icache = NULL;
+  batch->pool = NULL;
+  if (!f)
+    return 0;
+  if (!rv32_read_image_header(f, &header) || header.code_addr != 0) {
+    fclose(f);
+    return 0;
+  }
+  batch->memory_size = instance_size * instance_count;
+#ifdef RV32_IMAGE_MMAP
+  batch->memory = mmap(NULL, batch->memory_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (batch->memory == MAP_FAILED)
+    batch->memory = NULL;
+#else
+  batch->memory = malloc(batch->memory_size);
+#endif
+  batch->instances = (RV32 **)malloc(instance_count * sizeof(RV32 *));
+  batch->budgets = (uint32_t *)malloc(instance_count * sizeof(uint32_t));
+  batch->executed = (uint64_t *)malloc(instance_count * sizeof(uint64_t));
+  batch->icache = (rv32_decoded *)malloc(RV32_ICACHE_NEEDED_MEMORY(header.code_size));
+  if (!batch->memory || !batch->instances || !batch->budgets || !batch->executed ||
+      !batch->icache) {
+    fclose(f);
+    rv32_batch_free(batch);
+    return 0;
+  }
+  for (i = 0; i < instance_count; i++) {
+    uint8_t *memory = (uint8_t *)batch->memory + i * instance_size;
+    RV32 *rv32 = rv32_new(memory + header_size - RV32_MEM_OFFSET, mem_size);
+    batch->instances[i] = rv32;
+    batch->instance_count++;
+    batch->budgets[i] = 0;
+    batch->executed[i] = 0;
+    if (!rv32_load_sections(rv32, f, &header)) {
+      fclose(f);
+      rv32_batch_free(batch);
+      return 0;
+    }
+    if (i == 0) {
+      rv32_attach_icache(rv32, batch->icache, header.code_size);
+      rv32_decode_icache(rv32);
+    }
+    rv32_share_icache(rv32, batch->icache, header.code_size);
+  }
+  fclose(f);
+  batch->pool = rv32_pool_new(batch, thread_count);
+  if (!batch->pool) {
+    rv32_batch_free(batch);
+    return 0;
+  }
+  return 1;
+}
+
+void rv32_batch_free(rv32_batch *batch) {
+  if (batch->pool)
+    rv32_pool_free(batch->pool);
+#ifdef RV32_IMAGE_MMAP
+  if (batch->memory)
+    munmap(batch->memory, batch->memory_size);
+#else
+  free(batch->memory);
+#endif
+  free(batch->instances);
+  free(batch->budgets);
+  free(batch->executed);
+  free(batch->icache);
+  batch->memory = NULL;
+  batch->instances = NULL;
+  batch->budgets = NULL;
+  batch->executed = NULL;
+  batch->icache = NULL;
+  batch->pool = NULL;
+  batch->instance_count = 0;
+}
+
+/* Runs every instance until it stops or has run its budget. Instances that are still running
+   continue from there on the next call. Returns the number of instructions run by all */
+uint64_t rv32_batch_run(rv32_batch *batch) {
+  rv32_pool *pool = batch->pool;
+  uint64_t executed = 0;
+  unsigned int t;
+  if (batch->instance_count == 0)
+    return 0;
+  for (t = 0; t < pool->worker_count; t++) {
+    pool->workers[t].next = (uint64_t)batch->instance_count * t / pool->worker_count;
+    pool->workers[t].end = (uint64_t)batch->instance_count * (t + 1) / pool->worker_count;
+    pool->workers[t].executed = 0;
+  }
+#ifdef RV32_THREADS
+  if (pool->threads) {
+    pthread_mutex_lock(&pool->lock);
+    pool->run++;
+    pool->busy = pool->started - 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    rv32_worker_run(&pool->workers[0]);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy)
+      pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+  } else
+#endif
+    rv32_worker_run(&pool->workers[0]);
+  for (t = 0; t < pool->worker_count; t++)
+    executed += pool->workers[t].executed;
+  return executed;
+}
+
 #endif /* RV32_IMPLEMENTATION */
 #endif /* INCLUDE_RV32_H */
\ No newline at end of file
@@ -18,7 +18,7 @@ void vera_string_print(vera_string *str) {
     printf("\"");
 }
 
-int main(void) {
+int main(int argc, char **argv) {
     const char *src = 
     "|| sugar\n"
     "||  oranges\n"
@@ -35,36 +35,35 @@ int main(void) {
     };
 
     vera_ctx ctx;
-    vera_init_ctx(&ctx, src, NULL, 0);
+    /* the rules can also be read from a file */
+    if(argc > 1)
+        vera_init_ctx_file(&ctx, argv[1]);
+    else
+        vera_init_ctx_arena(&ctx, src);
     vera_add_ports(&ctx, ports, ARRAY_SIZE(ports));
-    size_t pool_size = vera_parse(&ctx);
-    printf("%zu objects parsed\n", pool_size);
-
-    size_t bytes = sizeof(vera_obj) * pool_size;
-    printf("allocating %zu bytes\n", bytes);
-    vera_obj *pool = (vera_obj*)malloc(bytes);
-    vera_init_ctx(&ctx, src, pool, pool_size);
-    vera_add_ports(&ctx, ports, ARRAY_SIZE(ports));
-    vera_parse(&ctx);
+    size_t obj_count = vera_parse(&ctx);
+    printf("%zu objects parsed (%zu bytes)\n", obj_count, sizeof(vera_obj) * obj_count);
     vera_intern_strings(&ctx);
     for(int i = 0; i < ctx.obj_count; i++) {
-        printf("%d\t type=%d\t", i, ctx.pool[i].type);
-        vera_obj *obj = &ctx.pool[i];
-        if(obj->type == VERA_PORT) {
-            printf("interned=%d\t", obj->as.port.intern);
-            vera_string_print(&ctx.pool[i].as.port.vstr);
-        } else if(obj->type == VERA_FACT) {
-            printf("interned=%d\t", obj->as.fact.intern);
-            vera_string_print(&ctx.pool[i].as.fact.vstr);
+        vera_obj *obj = vera_get_obj(&ctx, i);
+        printf("%d\t type=%d\t", i, obj->type);
+        if(obj->type == VERA_PORT || obj->type == VERA_FACT) {
+            vera_string vstr = vera_obj_string(&ctx, obj);
+            printf("interned=%d\t", obj->intern);
+            vera_string_print(&vstr);
         }
         printf("\n");
     }
     printf("%d registers\n", ctx.register_count);
 
 
-    const size_t binary_size_max = 1024;
-    uint8_t binary[binary_size_max];
-    size_t binary_size = vera_riscv32_codegen(&ctx, binary, binary_size_max);
+    size_t binary_size = vera_riscv32_codegen(&ctx, NULL, 0);
+    uint8_t *binary = (uint8_t*)malloc(binary_size);
+    if(!binary) {
+        fprintf(stderr, "failed to allocate the binary\n");
+        return 1;
+    }
+    vera_riscv32_codegen(&ctx, binary, binary_size);
 
     FILE *f = fopen("out.bin", "wb");
     if(f) {
@@ -75,6 +74,20 @@ int main(void) {
         fprintf(stderr, "failed to open binary file\n");
     }
 
-    free(pool);
+    /* the same program as an image, with the names of the registers */
+    uint8_t *image;
+    size_t image_size = vera_riscv32_image(&ctx, &image);
+    f = fopen("out.vera", "wb");
+    if(f) {
+        if(!fwrite(image, image_size, 1, f))
+            fprintf(stderr, "failed to write image to file\n");
+        fclose(f);
+    } else {
+        fprintf(stderr, "failed to open image file\n");
+    }
+
+    free(image);
+    free(binary);
+    vera_free_ctx(&ctx);
     return 0;
 }
\ No newline at end of file
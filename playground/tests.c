@@ -1,12 +1,20 @@
+#define _DEFAULT_SOURCE /* for MAP_ANONYMOUS */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <dirent.h>
 #define VERA_IMPLEMENTATION
 #define VERA_RISCV32
+#define VERA_THREADS
+#if defined(__x86_64__) && defined(__linux__)
+#define VERA_X86_64
+#endif
 #include "vera.h"
 #define LITTLE_ENDIAN_HOST
 #define RV32_IMPLEMENTATION
+#define RV32_THREADS
 #define TRACE
 #include "rv32.h"
 
@@ -51,29 +59,73 @@ void test_scmp(void) {
     }
 }
 
-rv32_mmio_result_t mmio_load8(uint32_t addr, uint8_t *ret) { return RV32_MMIO_ERR; }
-rv32_mmio_result_t mmio_load16(uint32_t addr, uint16_t *ret) { return RV32_MMIO_ERR; }
-rv32_mmio_result_t mmio_load32(uint32_t addr, uint32_t *ret) { return RV32_MMIO_ERR; }
-rv32_mmio_result_t mmio_store8(uint32_t addr, uint8_t val) { return RV32_MMIO_ERR; }
-rv32_mmio_result_t mmio_store16(uint32_t addr, uint16_t val) { return RV32_MMIO_ERR; }
-rv32_mmio_result_t mmio_store32(uint32_t addr, uint32_t val) { return RV32_MMIO_ERR; }
-void ecall(RV32 *rv32) { }
-
+void test_intern_strings(void) {
+    const char *src =
+    "|| b\n"
+    "| a  b , c|  b ,a\n"
+    "|c\t a| d e, @in\n"
+    "|d   e|a,  c   a";
+    const char *ports[] = { "@in", "@out" };
+    /* registers are numbered in order of first appearance, ports first */
+    const int expected[] = { 0, 1, 2, 3, 4, 2, 5, 6, 7, 0, 7, 5, 6 };
+    vera_ctx ctx;
+    vera_init_ctx_arena(&ctx, src);
+    vera_add_ports(&ctx, ports, 2);
+    vera_parse(&ctx);
+    vera_intern_strings(&ctx);
+    int n = 0;
+    for(size_t i = 0; i < ctx.obj_count; i++) {
+        vera_obj *obj = vera_get_obj(&ctx, i);
+        if(obj->type == VERA_PORT || obj->type == VERA_FACT)
+            assert(obj->intern == expected[n++]);
+    }
+    assert(n == sizeof(expected) / sizeof(expected[0]));
+    assert(ctx.register_count == 8);
+    vera_free_ctx(&ctx);
+}
 
-int main(void) {
-    test_scmp();
-    RV32 *rv32;
-    uint8_t *memory = NULL;
-    const size_t ram_size = 0x10000;
-    memory = (uint8_t*)malloc(RV32_NEEDED_MEMORY(ram_size));
-    if(!memory) {
-        fprintf(stderr, "Failed to allocate memory.\n");
-        return 1;
+/* the same source parsed in the two pass mode and in the arena must give the same objects */
+void test_parse_modes(void) {
+    const char *src =
+    "|| a: 3, b\n"
+    "|a ?, b|c: 12\n"
+    "|c|d";
+    vera_ctx ctx, arena_ctx;
+    vera_init_ctx(&ctx, src, NULL, 0);
+    size_t pool_size = vera_parse(&ctx);
+    vera_obj *pool = (vera_obj*)malloc(sizeof(vera_obj) * pool_size);
+    vera_init_ctx(&ctx, src, pool, pool_size);
+    vera_parse(&ctx);
+    vera_init_ctx_arena(&arena_ctx, src);
+    assert(vera_parse(&arena_ctx) == pool_size);
+    for(size_t i = 0; i < pool_size; i++) {
+        vera_obj *obj = vera_get_obj(&arena_ctx, i);
+        assert(obj->type == pool[i].type);
+        if(obj->type == VERA_FACT) {
+            assert(obj->offset == pool[i].offset && obj->len == pool[i].len);
+            assert(obj->keep == pool[i].keep && obj->count == pool[i].count);
+        }
     }
-    rv32 = rv32_new(memory, ram_size);
+    assert(vera_get_obj(&arena_ctx, 2)->count == 3);
+    assert(vera_get_obj(&arena_ctx, 5)->keep == 1);
+    assert(vera_get_obj(&arena_ctx, 8)->count == 12);
+    vera_free_ctx(&arena_ctx);
+    free(pool);
+}
+
+/* the ports of a program are a MMIO region, with its vera_port_io as user pointer */
+#define PORT_MMIO_BASE 0x40000000
+
+static rv32_mmio_result_t port_load32(void *user, uint32_t offset, uint32_t *ret) {
+    return vera_port_io_load((vera_port_io*)user, offset, ret) ? RV32_MMIO_OK : RV32_MMIO_ERR;
+}
+static rv32_mmio_result_t port_store32(void *user, uint32_t offset, uint32_t val) {
+    return vera_port_io_store((vera_port_io*)user, offset, val) ? RV32_MMIO_OK : RV32_MMIO_ERR;
+}
+static const rv32_mmio_ops port_ops = { NULL, NULL, port_load32, NULL, NULL, port_store32 };
 
 
-    const char *src = 
+const char *samples[] = {
     "|| sugar\n"
     "||  oranges\n"
     "|| apples  ,   apples\n"
@@ -82,45 +134,1025 @@ int main(void) {
     "\n"
     "|      flour,      sugar,    apples|  apple cake\n"
     "|     apples,    oranges,  cherries   |   fruit    salad\n"
-    "|fruit   salad,   apple  cake             |  fruit  cake   ";
-    vera_ctx ctx;
-    vera_init_ctx(&ctx, src, NULL, 0);
-    size_t pool_size = vera_parse(&ctx);
-    printf("%zu objects parsed\n", pool_size);
+    "|fruit   salad,   apple  cake             |  fruit  cake   ",
 
-    size_t bytes = sizeof(vera_obj) * pool_size;
-    printf("allocating %zu bytes\n", bytes);
-    vera_obj *pool = (vera_obj*)malloc(bytes);
-    vera_init_ctx(&ctx, src, pool, pool_size);
-    vera_parse(&ctx);
-    vera_intern_strings(&ctx);
+    "|| a: 5, b: 3, c\n"
+    "|a, b?|d: 2\n"
+    "|d, c?|e\n"
+    "|e, e|f: 3",
+
+    "#x, y#x: 2, z\n"
+    "#x?, x#y\n"
+    "#z?, z, x#w: 3\n"
+    "#y?, z#w: 3\n"
+    "##x: 7, y",
+
+    "|| a: 2, b: 3\n"
+    "|a|c\n|b|d: 2\n|c, d|e\n|e|f, g\n|f|h\n|g|i\n|h, i|j\n|j|k\n"
+    "|k|l\n|l|m\n|m|n\n|n|o\n|o|p\n|d?, p|q: 3"
+};
+
+static void assert_same_objects(vera_ctx *ctx1, vera_ctx *ctx2) {
+    assert(ctx1->obj_count == ctx2->obj_count);
+    for(size_t i = 0; i < ctx1->obj_count; i++) {
+        vera_obj *obj1 = vera_get_obj(ctx1, i), *obj2 = vera_get_obj(ctx2, i);
+        assert(obj1->type == obj2->type);
+        if(obj1->type == VERA_FACT) {
+            vera_string vstr1 = vera_obj_string(ctx1, obj1), vstr2 = vera_obj_string(ctx2, obj2);
+            assert(obj1->offset == obj2->offset && obj1->len == obj2->len);
+            assert(obj1->keep == obj2->keep && obj1->count == obj2->count);
+            assert(!memcmp(vstr1.string, vstr2.string, vstr1.len));
+        }
+    }
+}
 
-    size_t binary_size = vera_riscv32_codegen(&ctx, rv32->mem, 1024);
+/* The bounded, chunked and file sources must give the same objects as a NUL terminated string */
+void test_input_modes(void) {
+    const char *sources[sizeof(samples) / sizeof(samples[0]) + 1];
+    for(size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++)
+        sources[i] = samples[i];
+    sources[sizeof(sources) / sizeof(sources[0]) - 1] = "|| a: 2\n|a|"; /* empty rhs at the end */
+    for(size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        const size_t len = strlen(sources[i]);
+        vera_ctx ref, ctx;
+        vera_init_ctx_arena(&ref, sources[i]);
+        vera_parse(&ref);
 
+        /* not NUL terminated */
+        char *copy = (char*)malloc(len + 1);
+        memcpy(copy, sources[i], len);
+        copy[len] = '|';
+        vera_init_ctx_len(&ctx, copy, len);
+        vera_parse(&ctx);
+        assert_same_objects(&ref, &ctx);
+        vera_free_ctx(&ctx);
+        free(copy);
+
+        for(size_t chunk = 1; chunk <= 7; chunk += 2) {
+            vera_init_ctx_stream(&ctx);
+            for(size_t pos = 0; pos < len; pos += chunk)
+                vera_feed(&ctx, sources[i] + pos, pos + chunk < len ? chunk : len - pos);
+            vera_parse(&ctx);
+            assert_same_objects(&ref, &ctx);
+            vera_free_ctx(&ctx);
+        }
+
+        char path[] = "/tmp/vera_testXXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        assert(write(fd, sources[i], len) == len);
+        close(fd);
+        vera_init_ctx_file(&ctx, path);
+        vera_parse(&ctx);
+        assert_same_objects(&ref, &ctx);
+        vera_free_ctx(&ctx);
+        unlink(path);
+
+        vera_free_ctx(&ref);
+    }
+}
+
+/* Runs the program in the emulator with `fuel` in a1, resumed while it stops because it has
+   used all its fuel if `resume`, with the predecoded code if `cached`. Copies the final value of the
+   registers into `registers` and returns the number of firings of the last run */
+uint32_t run_riscv32_fuel(vera_ctx *ctx, uint32_t *registers, int cached, uint32_t fuel, int resume) {
+    RV32 *rv32;
+    uint8_t *memory = NULL;
+    size_t binary_size = vera_riscv32_codegen(ctx, NULL, 0);
+    const size_t ram_size = (binary_size + 0xffff) & ~(size_t)0xffff;
+    memory = (uint8_t*)malloc(RV32_NEEDED_MEMORY(ram_size));
+    if(!memory) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        exit(1);
+    }
+    rv32 = rv32_new(memory, ram_size);
+
+    assert(vera_riscv32_codegen(ctx, rv32->mem, ram_size) == binary_size);
+    void *icache = malloc(RV32_ICACHE_NEEDED_MEMORY(binary_size));
+    if(cached)
+        rv32_attach_icache(rv32, icache, binary_size);
+
+    rv32->r[REG_A1] = fuel;
     do {
+        rv32->pc = 0;
+        rv32->status = RV32_RUNNING;
         while (rv32->status == RV32_RUNNING) {
-            rv32_cycle(rv32);
+            if(cached)
+                rv32_run(rv32, 1000);
+            else
+                rv32_cycle(rv32);
             switch(rv32->status) {
             case RV32_RUNNING:
                 break;
             case RV32_EBREAK:
-                fprintf(stderr, "ebreak at pc=%08x\n", rv32->pc);
-                if(rv32->r[REG_A0]) {
-                    rv32->pc = 0;
-                    rv32->status = RV32_RUNNING;
-                }
+                fprintf(stderr, "ebreak at pc=%08x, %u firings\n", rv32->pc, rv32->r[REG_A0]);
                 break;
             default:
                 fprintf(stderr, "Error %d at pc=%08x\n", rv32->status, rv32->pc);
                 fprintf(stderr, "instr = %08x\n", *(uint32_t *)&rv32->mem[rv32->pc]);
+                exit(1);
             }
         }
-    } while(rv32->r[REG_A0] == 1);
-    for(unsigned int i = 0; i < ctx.register_count; i++) {
-        printf("%u:\t%u\n", i, ((uint32_t*)rv32->mem)[1 + i]);
+    } while(resume && rv32->r[REG_A0] == fuel);
+    const uint32_t firings = rv32->r[REG_A0];
+    /* the registers are at the end of the program */
+    const uint32_t *final = (uint32_t*)(rv32->mem + binary_size) - ctx->register_count;
+    for(unsigned int i = 0; i < ctx->register_count; i++)
+        registers[i] = final[i];
+    free(icache);
+    free(memory);
+    return firings;
+}
+
+/* Runs the program in the emulator until no rule applies, with the predecoded code if `cached`,
+   and copies the final value of the registers into `registers` */
+void run_riscv32(vera_ctx *ctx, uint32_t *registers, int cached) {
+    /* a small fuel, so that the program has to be resumed a few times */
+    run_riscv32_fuel(ctx, registers, cached, 3, 1);
+    for(unsigned int i = 0; i < ctx->register_count; i++)
+        printf("%u:\t%u\n", i, registers[i]);
+}
+
+void test_rv32_run(void) {
+    for(size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        vera_ctx ctx;
+        vera_init_ctx_arena(&ctx, samples[i]);
+        vera_parse(&ctx);
+        vera_intern_strings(&ctx);
+        uint32_t expected[ctx.register_count], registers[ctx.register_count];
+        run_riscv32(&ctx, expected, 0);
+        run_riscv32(&ctx, registers, 1);
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            assert(registers[j] == expected[j]);
+        vera_free_ctx(&ctx);
+    }
+}
+
+/* Size of the code, without the padding of vera_riscv32_codegen and the data page */
+static uint32_t riscv32_code_size(vera_ctx *ctx) {
+    uint8_t *image;
+    vera_riscv32_image(ctx, &image);
+    const uint32_t size = ((vera_image_header*)image)->code_size;
+    free(image);
+    return size;
+}
+
+/* Every kind of compressed instruction, run by rv32_cycle then from the icache, and the
+   samples assembled with and without them */
+void test_rvc(void) {
+    static const uint16_t code[] = {
+        0x4515, /* c.li a0, 5 */
+        0x6585, /* c.lui a1, 1 */
+        0x15f1, /* c.addi a1, -4 */
+        0x862a, /* c.mv a2, a0 */
+        0x962a, /* c.add a2, a0 */
+        0x060a, /* c.slli a2, 2 */
+        0x8205, /* c.srli a2, 1 */
+        0x9a61, /* c.andi a2, -8 */
+        0x8e09, /* c.sub a2, a0 */
+        0x8e29, /* c.xor a2, a0 */
+        0x8e49, /* c.or a2, a0 */
+        0x8e69, /* c.and a2, a0 */
+        0x6121, /* c.addi16sp sp, 64 */
+        0xc432, /* c.swsp a2, 8(sp) */
+        0x46a2, /* c.lwsp a3, 8(sp) */
+        0x0818, /* c.addi4spn a4, sp, 16 */
+        0xc354, /* c.sw a3, 4(a4) */
+        0x435c, /* c.lw a5, 4(a4) */
+        0xc399, /* c.beqz a5, +6 */
+        0xe391, /* c.bnez a5, +4 */
+        0x9002, /* c.ebreak : skipped */
+        0x2021, /* c.jal +8 */
+        0xa039, /* c.j +14 */
+        0x0001, /* c.nop */
+        0x0001, /* c.nop */
+        0x0513, 0x0645, /* addi a0, a0, 100 : not aligned on 4 bytes */
+        0x8082, /* c.jr ra */
+        0x0001, /* c.nop */
+        0x8589, /* c.srai a1, 2 */
+        0x9002, /* c.ebreak */
+    };
+    const size_t ram_size = 0x1000;
+    uint8_t *memory = (uint8_t*)malloc(RV32_NEEDED_MEMORY(ram_size));
+    void *icache = malloc(RV32_ICACHE_NEEDED_MEMORY(sizeof(code)));
+    for(int cached = 0; cached < 2; cached++) {
+        RV32 *rv32 = rv32_new(memory, ram_size);
+        memcpy(rv32->mem, code, sizeof(code));
+        if(cached) {
+            rv32_attach_icache(rv32, icache, sizeof(code));
+            rv32_run(rv32, 100);
+        } else {
+            while(rv32->status == RV32_RUNNING)
+                rv32_cycle(rv32);
+        }
+        assert(rv32->status == RV32_EBREAK && rv32->pc == 60);
+        assert(rv32->r[REG_A0] == 105 && rv32->r[REG_A1] == 0x3ff);
+        assert(rv32->r[REG_A2] == 5 && rv32->r[REG_A3] == 5 && rv32->r[REG_A4] == 80 && rv32->r[REG_A5] == 5);
+        assert(rv32->r[REG_SP] == 64 && rv32->r[REG_RA] == 44);
+        /* odd pc, and the all zero halfword which is not an instruction */
+        rv32->pc = 1;
+        rv32->status = RV32_RUNNING;
+        if(cached)
+            rv32_run(rv32, 100);
+        else
+            rv32_cycle(rv32);
+        assert(rv32->status == RV32_INVALID_MEMORY_ACCESS && rv32->pc == 1);
+        rv32->pc = sizeof(code);
+        rv32->status = RV32_RUNNING;
+        rv32_cycle(rv32);
+        assert(rv32->status == RV32_INVALID_INSTRUCTION);
     }
+    free(icache);
+
+    /* a jump into the middle of the last instruction decodes a 4 bytes one in the last entry */
+    static const uint16_t tail[] = {
+        0x006f, 0x0060, /* j 6 */
+        0x0013, 0x0003, /* addi x0, x6, 0 : lb x0, 0(x0) from its second half */
+        0x0000,
+        0x9002, /* c.ebreak, past the cache */
+    };
+    icache = malloc(RV32_ICACHE_NEEDED_MEMORY(8));
+    RV32 *rv32 = rv32_new(memory, ram_size);
+    memcpy(rv32->mem, tail, sizeof(tail));
+    rv32_attach_icache(rv32, icache, 8);
+    rv32_run(rv32, 100);
+    assert(rv32->status == RV32_EBREAK && rv32->pc == 10);
+    free(icache);
     free(memory);
 
+    for(size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        vera_ctx ctx;
+        vera_init_ctx_arena(&ctx, samples[i]);
+        vera_parse(&ctx);
+        vera_intern_strings(&ctx);
+        uint32_t expected[ctx.register_count], registers[ctx.register_count];
+        ctx.rvc = 0;
+        const uint32_t rvi_size = riscv32_code_size(&ctx);
+        run_riscv32(&ctx, expected, 1);
+        ctx.rvc = 1;
+        assert(riscv32_code_size(&ctx) < rvi_size);
+        run_riscv32(&ctx, registers, 1);
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            assert(registers[j] == expected[j]);
+        vera_free_ctx(&ctx);
+    }
+}
+
+void run_interpreter(vera_ctx *ctx, uint32_t *registers, int incremental) {
+    vera_program prog;
+    vera_program_init(&prog, ctx);
+    for(unsigned int i = 0; i < ctx->register_count; i++)
+        registers[i] = 0;
+    vera_fill_registers(ctx, registers);
+    if(incremental)
+        vera_run_incremental(&prog, registers, 0);
+    else
+        vera_run(&prog, registers, 0);
+    vera_program_free(&prog);
+}
+
+void test_interpreter(void) {
+    for(size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        vera_ctx ctx;
+        vera_init_ctx_arena(&ctx, samples[i]);
+        printf("%zu objects parsed\n", vera_parse(&ctx));
+        vera_intern_strings(&ctx);
+        uint32_t expected[ctx.register_count], registers[ctx.register_count];
+        run_riscv32(&ctx, expected, 0);
+        run_interpreter(&ctx, registers, 0);
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            assert(registers[j] == expected[j]);
+        run_interpreter(&ctx, registers, 1);
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            assert(registers[j] == expected[j]);
+        vera_free_ctx(&ctx);
+    }
+}
+
+void test_ring(void) {
+    vera_ring ring;
+    uint32_t values[5], *slots;
+    const uint32_t *readable;
+    vera_ring_init(&ring, 6);
+    assert(ring.capacity == 8);
+    for(uint32_t round = 0; round < 10; round++) {
+        for(uint32_t k = 0; k < 5; k++)
+            values[k] = round * 5 + k;
+        assert(vera_ring_write(&ring, values, 5) == 5);
+        /* the free slots wrap around the end of the buffer */
+        assert(vera_ring_writable(&ring, &slots) <= 3);
+        for(uint32_t k = 0; k < 5;) {
+            uint32_t n = vera_ring_readable(&ring, &readable);
+            assert(n > 0);
+            for(uint32_t m = 0; m < n; m++)
+                assert(readable[m] == round * 5 + k + m);
+            vera_ring_consume(&ring, n);
+            k += n;
+        }
+    }
+    assert(vera_ring_read(&ring, values, 5) == 0);
+    vera_ring_free(&ring);
+}
+
+static rv32_mmio_result_t word_load32(void *user, uint32_t offset, uint32_t *ret) {
+    *ret = ((uint32_t*)user)[offset / 4];
+    return RV32_MMIO_OK;
+}
+static rv32_mmio_result_t word_store32(void *user, uint32_t offset, uint32_t val) {
+    ((uint32_t*)user)[offset / 4] = val;
+    return RV32_MMIO_OK;
+}
+static void count_ecall(RV32 *rv32) {
+    (*(uint32_t*)rv32->user)++;
+}
+
+/* Two instances with the same region wired to their own words, one run from the icache */
+void test_mmio(void) {
+    static const rv32_mmio_ops word_ops = { NULL, NULL, word_load32, NULL, NULL, word_store32 };
+    static const uint32_t code[] = {
+        0x400002b7, /* lui t0, 0x40000 */
+        0x0002a303, /* lw t1, 0(t0) */
+        0x00130313, /* addi t1, t1, 1 */
+        0x0062a223, /* sw t1, 4(t0) */
+        0x00000073, /* ecall */
+        0x00028383, /* lb t2, 0(t0) : no 8 bit handler */
+    };
+    const size_t ram_size = 0x1000;
+    uint32_t words[2][2] = { { 10, 0 }, { 20, 0 } }, ecalls[2] = { 0, 0 };
+    void *icache = malloc(RV32_ICACHE_NEEDED_MEMORY(sizeof(code)));
+    for(int i = 0; i < 2; i++) {
+        uint8_t *memory = (uint8_t*)malloc(RV32_NEEDED_MEMORY(ram_size));
+        RV32 *rv32 = rv32_new(memory, ram_size);
+        memcpy(rv32->mem, code, sizeof(code));
+        assert(rv32_map_mmio(rv32, 0x40000000, 8, &word_ops, words[i]));
+        assert(!rv32_map_mmio(rv32, 0x40000004, 8, &word_ops, NULL));
+        assert(!rv32_map_mmio(rv32, 0x3ffffffc, 8, &word_ops, NULL));
+        rv32_set_ecall(rv32, count_ecall, &ecalls[i]);
+        if(i) {
+            rv32_attach_icache(rv32, icache, sizeof(code));
+            rv32_run(rv32, 100);
+        } else {
+            while(rv32->status == RV32_RUNNING)
+                rv32_cycle(rv32);
+        }
+        assert(rv32->status == RV32_INVALID_MEMORY_ACCESS && rv32->pc == 20);
+        assert(rv32->r[REG_T1] == words[i][0] + 1 && words[i][1] == words[i][0] + 1);
+        assert(ecalls[i] == 1);
+        /* without the region, the store faults */
+        assert(rv32_unmap_mmio(rv32, 0x40000000) && !rv32_unmap_mmio(rv32, 0x40000000));
+        rv32->pc = 0;
+        rv32->status = RV32_RUNNING;
+        while(rv32->status == RV32_RUNNING)
+            rv32_cycle(rv32);
+        assert(rv32->status == RV32_INVALID_MEMORY_ACCESS && rv32->pc == 4);
+        free(memory);
+    }
+    free(icache);
+}
+
+/* Increments streamed in and out of the ports while the emulator is running */
+void test_ports(void) {
+    const char *ports[] = { "@in", "@out" };
+    const char *src = "|@in|@out: 2, total";
+    vera_ctx ctx;
+    vera_port_io io;
+    RV32 *rv32;
+    const size_t ram_size = 0x10000;
+    uint8_t *memory = (uint8_t*)malloc(RV32_NEEDED_MEMORY(ram_size));
+    vera_init_ctx_arena(&ctx, src);
+    vera_add_ports(&ctx, ports, 2);
+    vera_parse(&ctx);
+    vera_intern_strings(&ctx);
+    ctx.port_mmio_base = PORT_MMIO_BASE;
+    rv32 = rv32_new(memory, ram_size);
+    const size_t binary_size = vera_riscv32_codegen(&ctx, rv32->mem, ram_size);
+    assert(binary_size <= ram_size);
+    vera_port_io_init(&io, 2, 2);
+    assert(rv32_map_mmio(rv32, PORT_MMIO_BASE, VERA_PORT_MMIO_SIZE(2), &port_ops, &io));
+    uint32_t sent = 0, received = 0, value;
+    rv32->r[REG_A1] = 0;
+    for(uint32_t round = 1; round <= 20; round++) {
+        /* more increments than the rings hold : the pending ones are merged */
+        for(uint32_t k = 0; k < 3; k++) {
+            if(vera_ring_write(&io.in[0], &round, 1))
+                sent += round;
+        }
+        rv32->pc = 0;
+        rv32->status = RV32_RUNNING;
+        while(rv32->status == RV32_RUNNING) {
+            rv32_cycle(rv32);
+            if(vera_ring_read(&io.out[1], &value, 1))
+                received += value;
+        }
+        assert(rv32->status == RV32_EBREAK);
+        assert(vera_port_io_flush(&io));
+        while(vera_ring_read(&io.out[1], &value, 1))
+            received += value;
+    }
+    /* registers are interned in order of appearance : @in, @out, then total */
+    const uint32_t *registers = (uint32_t*)(rv32->mem + binary_size) - ctx.register_count;
+    const uint32_t total = registers[2];
+    printf("sent %u, received %u, total %u\n", sent, received, total);
+    assert(total == sent);
+    assert(received == 2 * sent);
+    vera_port_io_free(&io);
+    vera_free_ctx(&ctx);
+    free(memory);
+}
+
+static int compile_cached(const char *dir, const char *src, uint32_t port_mmio_base, vera_artifact *artifact) {
+    const char *ports[] = { "@in", "@out" };
+    vera_ctx ctx;
+    vera_init_ctx_arena(&ctx, src);
+    vera_add_ports(&ctx, ports, 2);
+    ctx.port_mmio_base = port_mmio_base;
+    int hit = vera_riscv32_compile_cached(dir, &ctx, artifact);
+    vera_free_ctx(&ctx);
+    return hit;
+}
+
+/* Calls `action` on every file of `dir`, returns the number of files */
+static unsigned int for_each_file(const char *dir, void (*action)(const char *path)) {
+    char path[512];
+    unsigned int count = 0;
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    assert(d);
+    while((entry = readdir(d))) {
+        if(entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        action(path);
+        count++;
+    }
+    closedir(d);
+    return count;
+}
+
+static void damage_file(const char *path) { assert(truncate(path, 8) == 0); }
+static void remove_file(const char *path) { assert(unlink(path) == 0); }
+
+void test_compile_cache(void) {
+    char dir[] = "/tmp/vera_cacheXXXXXX";
+    vera_artifact artifact, fresh;
+    assert(mkdtemp(dir));
+    assert(!compile_cached(dir, samples[0], 0, &fresh));
+    assert(fresh.map);
+    assert(compile_cached(dir, samples[0], 0, &artifact));
+    assert(artifact.code_size == fresh.code_size && !memcmp(artifact.code, fresh.code, fresh.code_size));
+    /* the ports come first, then the facts in order of appearance */
+    const char *names = artifact.names;
+    assert(artifact.register_count == 10 && !strcmp(names, "@in"));
+    names += strlen(names) + 1;
+    names += strlen(names) + 1;
+    assert(!strcmp(names, "sugar"));
+    for(unsigned int j = 2; j < 8; j++)
+        names += strlen(names) + 1;
+    assert(!strcmp(names, "fruit salad"));
+    vera_artifact_free(&artifact);
+    vera_artifact_free(&fresh);
+    /* anything the code depends on changes the key */
+    assert(!compile_cached(dir, samples[1], 0, &artifact));
+    vera_artifact_free(&artifact);
+    assert(!compile_cached(dir, samples[0], PORT_MMIO_BASE, &artifact));
+    vera_artifact_free(&artifact);
+    /* no temporary file is left behind, and damaged entries are compiled again */
+    assert(for_each_file(dir, damage_file) == 3);
+    assert(!compile_cached(dir, samples[0], 0, &artifact));
+    vera_artifact_free(&artifact);
+    assert(compile_cached(dir, samples[0], 0, &artifact));
+    vera_artifact_free(&artifact);
+    assert(for_each_file(dir, remove_file) == 3);
+    assert(rmdir(dir) == 0);
+}
+
+/* Loads the image with the RAM `offset` bytes after a page boundary (0 maps the sections,
+   anything else copies them), runs it and checks the final registers */
+static void run_image(const char *path, size_t offset, const uint32_t *expected) {
+    const size_t ram_size = 0x10000, memory_size = RV32_NEEDED_MEMORY(ram_size) + 2 * VERA_RISCV32_PAGE_SIZE;
+    vera_image_header header;
+    FILE *f = fopen(path, "rb");
+    assert(f && fread(&header, sizeof(header), 1, f) == 1);
+    fclose(f);
+    uint8_t *memory = (uint8_t*)mmap(NULL, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(memory != MAP_FAILED);
+    RV32 *rv32 = rv32_new(memory + VERA_RISCV32_PAGE_SIZE - RV32_MEM_OFFSET + offset, ram_size);
+    assert(rv32_load_image(rv32, path));
+    assert(rv32->pc == header.entry);
+    rv32->r[REG_A1] = 0;
+    while(rv32->status == RV32_RUNNING)
+        rv32_cycle(rv32);
+    assert(rv32->status == RV32_EBREAK && rv32->pc == header.halt);
+    const uint32_t *registers = (uint32_t*)(rv32->mem + header.data_addr);
+    for(unsigned int j = 0; j < header.register_count; j++)
+        assert(registers[j] == expected[j]);
+    munmap(memory, memory_size);
+}
+
+void test_image(void) {
+    char path[] = "/tmp/vera_imageXXXXXX";
+    vera_ctx ctx;
+    uint8_t *image;
+    vera_init_ctx_arena(&ctx, samples[0]);
+    vera_parse(&ctx);
+    vera_intern_strings(&ctx);
+    uint32_t expected[ctx.register_count];
+    run_riscv32(&ctx, expected, 0);
+    const size_t size = vera_riscv32_image(&ctx, &image);
+    assert(vera_image_check(image, size));
+    assert(!vera_image_check(image, size - 1));
+    const vera_image_header *header = (const vera_image_header*)image;
+    assert(header->code_offset % VERA_RISCV32_PAGE_SIZE == 0 && header->data_offset % VERA_RISCV32_PAGE_SIZE == 0);
+    assert(header->data_addr % VERA_RISCV32_PAGE_SIZE == 0 && header->register_count == ctx.register_count);
+    /* the names let the host read the registers without the source */
+    assert(!strcmp(vera_image_name(image, 0), "sugar"));
+    assert(!strcmp(vera_image_name(image, 6), "fruit salad"));
+    assert(vera_image_name(image, ctx.register_count) == NULL);
+    int fd = mkstemp(path);
+    assert(fd >= 0 && write(fd, image, size) == size);
+    close(fd);
+    run_image(path, 0, expected);
+    run_image(path, 8, expected);
+    /* the first run didn't write to the file */
+    fd = open(path, O_RDONLY);
+    uint8_t *copy = (uint8_t*)malloc(size);
+    assert(fd >= 0 && read(fd, copy, size) == size && !memcmp(copy, image, size));
+    close(fd);
+    free(copy);
+    assert(unlink(path) == 0);
+    free(image);
+    vera_free_ctx(&ctx);
+}
+
+/* Checks the counters of a run against the expected lines and counts of the rules */
+static void check_profile(vera_ctx *ctx, const uint32_t *counters, const uint32_t *lines,
+                          const uint64_t *fired, const uint64_t *rejected) {
+    vera_profile profile;
+    vera_profile_init(&profile, ctx);
+    vera_profile_add(&profile, counters);
+    for(unsigned int r = 0; r < profile.rule_count; r++) {
+        printf("line %u: %llu fired, %llu rejected\n", profile.rules[r].line,
+               (unsigned long long)profile.rules[r].fired, (unsigned long long)profile.rules[r].rejected);
+        assert(profile.rules[r].line == lines[r]);
+        assert(profile.rules[r].fired == fired[r] && profile.rules[r].rejected == rejected[r]);
+    }
+    vera_profile_free(&profile);
+}
+
+/* Instances of one image with their own input, over several threads and budgets */
+void test_rv32_batch(void) {
+    char path[] = "/tmp/vera_batchXXXXXX";
+    const unsigned int instance_count = 64;
+    const char *ports[] = { "@b" };
+    vera_ctx ctx;
+    rv32_batch batch;
+    uint8_t *image;
+    vera_program prog;
+    /* the first rule doesn't apply at first : the budgeted instances stop on its branch */
+    vera_init_ctx_arena(&ctx, "|@b, c|e\n|@b, a|c: 2\n|a|d\n||a: 5");
+    vera_add_ports(&ctx, ports, 1);
+    vera_parse(&ctx);
+    vera_intern_strings(&ctx);
+    const size_t size = vera_riscv32_image(&ctx, &image);
+    const vera_image_header header = *(const vera_image_header*)image;
+    uint32_t expected[ctx.register_count];
+    vera_program_init(&prog, &ctx);
+    int fd = mkstemp(path);
+    assert(fd >= 0 && write(fd, image, size) == size);
+    close(fd);
+    assert(rv32_batch_init(&batch, path, instance_count, 0x10000, 3));
+    for(unsigned int i = 0; i < instance_count; i++) {
+        ((uint32_t*)(batch.instances[i]->mem + header.data_addr))[0] = i;
+        batch.budgets[i] = i % 2 ? 1 : 0;
+    }
+    uint64_t executed = rv32_batch_run(&batch), sum = 0;
+    for(unsigned int i = 0; i < instance_count; i++) {
+        sum += batch.executed[i];
+        assert(batch.instances[i]->status == (i % 2 ? RV32_RUNNING : RV32_EBREAK));
+        batch.budgets[i] = 0;
+    }
+    assert(executed == sum);
+    assert(rv32_batch_run(&batch) > 0);
+    for(unsigned int i = 0; i < instance_count; i++) {
+        RV32 *rv32 = batch.instances[i];
+        const uint32_t *registers = (uint32_t*)(rv32->mem + header.data_addr);
+        memset(expected, 0, sizeof(expected));
+        vera_fill_registers(&ctx, expected);
+        expected[0] = i;
+        vera_run(&prog, expected, 0);
+        assert(rv32->status == RV32_EBREAK && rv32->pc == header.halt);
+        assert(!memcmp(registers, expected, sizeof(expected)));
+    }
+    /* the code is shared : a store to it faults */
+    RV32 *rv32 = batch.instances[0];
+    const uint32_t store = 0x00002023; /* sw zero, 0(zero) */
+    memcpy(rv32->mem + 0x8000, &store, 4);
+    rv32->pc = 0x8000;
+    rv32->status = RV32_RUNNING;
+    rv32_run(rv32, 1);
+    assert(rv32->status == RV32_INVALID_MEMORY_ACCESS && rv32->pc == 0x8000);
+    assert(!memcmp(rv32->mem, image + header.code_offset, 4));
+    rv32_batch_free(&batch);
+    vera_program_free(&prog);
+    assert(unlink(path) == 0);
+    free(image);
+    vera_free_ctx(&ctx);
+}
+
+void test_profile(void) {
+    /* the last rule makes c for the first one, then neither applies */
+    const char *src =
+        "|| a: 3, b\n"
+        "\n"
+        "|c|d\n"
+        "||e\n"
+        "|a, b|c";
+    const uint32_t lines[] = { 3, 5 };
+    const uint64_t fired[] = { 1, 1 }, rejected[] = { 1, 1 };
+    vera_ctx ctx;
+    vera_init_ctx_arena(&ctx, src);
+    vera_parse(&ctx);
+    vera_intern_strings(&ctx);
+    const size_t plain_size = vera_riscv32_codegen(&ctx, NULL, 0);
+    ctx.profile = 1;
+    const size_t ram_size = 0x10000;
+    uint8_t *memory = (uint8_t*)malloc(RV32_NEEDED_MEMORY(ram_size));
+    RV32 *rv32 = rv32_new(memory, ram_size);
+    const size_t size = vera_riscv32_codegen(&ctx, rv32->mem, ram_size);
+    assert(size > plain_size && size <= ram_size);
+    rv32->r[REG_A1] = 0;
+    while(rv32->status == RV32_RUNNING)
+        rv32_cycle(rv32);
+    assert(rv32->status == RV32_EBREAK && rv32->r[REG_A0] == 2);
+    /* the registers, then 2 counters for each of the 2 rules */
+    const uint32_t *counters = (uint32_t*)(rv32->mem + size) - 4;
+    check_profile(&ctx, counters, lines, fired, rejected);
+    free(memory);
+#ifdef VERA_X86_64
+    vera_x86_64_code code;
+    uint32_t registers[ctx.register_count + 4];
+    memset(registers, 0, sizeof(registers));
+    vera_fill_registers(&ctx, registers);
+    vera_x86_64_codegen(&ctx, &code);
+    assert(code.run(registers, 0) == 2);
+    check_profile(&ctx, registers + ctx.register_count, lines, fired, rejected);
+    vera_x86_64_free(&code);
+#endif
+    vera_free_ctx(&ctx);
+}
+
+/* Writes a random program into `buffer`, which must be large enough (64 bytes per rule) */
+void random_program(char *buffer, uint32_t seed, unsigned int rule_count, unsigned int fact_count) {
+    char *p = buffer;
+    uint32_t state = seed;
+#define RANDOM(n) ((state = state * 1103515245 + 12345) >> 16) % (n)
+    p += sprintf(p, "|| f0: 5, f1: 3, f2");
+    for(unsigned int i = 0; i < rule_count; i++) {
+        unsigned int lhs = 1 + RANDOM(3), rhs = RANDOM(3);
+        *p++ = '\n';
+        *p++ = '|';
+        for(unsigned int j = 0; j < lhs; j++) {
+            unsigned int fact = RANDOM(fact_count), keep = RANDOM(4) == 0;
+            p += sprintf(p, "%sf%u%s", j ? ", " : "", fact, keep ? "?" : "");
+        }
+        *p++ = '|';
+        /* an empty rhs is only allowed if it isn't the last rule */
+        if(rhs == 0 && i == rule_count - 1)
+            rhs = 1;
+        for(unsigned int j = 0; j < rhs; j++) {
+            unsigned int fact = RANDOM(fact_count), count = 1 + RANDOM(3);
+            p += sprintf(p, "%sf%u: %u", j ? ", " : "", fact, count);
+        }
+    }
+    *p = '\0';
+#undef RANDOM
+}
+
+void test_incremental(void) {
+    const unsigned int rule_count = 5000;
+    char *src = (char*)malloc(64 * rule_count);
+    for(uint32_t seed = 1; seed <= 4; seed++) {
+        vera_ctx ctx;
+        vera_program prog;
+        random_program(src, seed, rule_count, 300);
+        vera_init_ctx_arena(&ctx, src);
+        vera_parse(&ctx);
+        vera_intern_strings(&ctx);
+        vera_program_init(&prog, &ctx);
+        uint32_t expected[ctx.register_count], registers[ctx.register_count], bitset[ctx.register_count];
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            expected[j] = registers[j] = bitset[j] = 0;
+        vera_fill_registers(&ctx, expected);
+        vera_fill_registers(&ctx, registers);
+        vera_fill_registers(&ctx, bitset);
+        /* random programs don't always terminate */
+        uint32_t firings = vera_run(&prog, expected, 2000);
+        printf("%u firings\n", firings);
+        assert(vera_run_incremental(&prog, registers, 2000) == firings);
+        assert(vera_run_bitset(&prog, bitset, 2000) == firings);
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            assert(registers[j] == expected[j] && bitset[j] == expected[j]);
+        vera_program_free(&prog);
+        vera_free_ctx(&ctx);
+    }
+    free(src);
+}
+
+void test_resume(void) {
+    vera_ctx ctx;
+    vera_program prog;
+    vera_init_ctx_arena(&ctx, samples[0]);
+    vera_parse(&ctx);
+    vera_intern_strings(&ctx);
+    vera_program_init(&prog, &ctx);
+    /* every rule consumes its lhs and feeds a later rule : the chain is followed without rescans */
+    assert(prog.rule_count == 3);
+    for(unsigned int rule = 0; rule < prog.rule_count; rule++)
+        assert(prog.resume[rule] == rule + 1);
+    vera_program_free(&prog);
+    vera_free_ctx(&ctx);
+    /* b is kept, so the first rule may apply again, and c makes the first rule apply */
+    vera_init_ctx_arena(&ctx, "|a, b?|c\n|c|a");
+    vera_parse(&ctx);
+    vera_intern_strings(&ctx);
+    vera_program_init(&prog, &ctx);
+    assert(prog.resume[0] == 0 && prog.resume[1] == 0);
+    vera_program_free(&prog);
+    vera_free_ctx(&ctx);
+}
+
+void test_live(void) {
+    /* z is never produced, so c isn't either, and s is a sink */
+    const char *src = "|| a: 2\n|a|b\n|z|c\n|b|s: 3\n|c|a";
+    const uint8_t expected_live[] = { 1, 0, 1, 0 };
+    vera_ctx ctx;
+    vera_program prog;
+    uint8_t live[4];
+    vera_init_ctx_arena(&ctx, src);
+    vera_parse(&ctx);
+    vera_intern_strings(&ctx);
+    vera_program_init(&prog, &ctx);
+    uint32_t registers[ctx.register_count], expected[ctx.register_count];
+    memset(registers, 0, sizeof(registers));
+    vera_fill_registers(&ctx, registers);
+    vera_program_live(&prog, registers, NULL, live);
+    assert(!memcmp(live, expected_live, sizeof(live)));
+    /* the dead rules have no code, and the sink keeps its final count */
+    const uint32_t size = riscv32_code_size(&ctx);
+    run_riscv32(&ctx, registers, 0);
+    run_interpreter(&ctx, expected, 0);
+    assert(!memcmp(registers, expected, sizeof(registers)) && expected[4] == 6);
+    vera_program_free(&prog);
+    vera_free_ctx(&ctx);
+    /* with z as a port, the host can make every rule fire */
+    const char *ports[] = { "z" };
+    vera_init_ctx_arena(&ctx, src);
+    vera_add_ports(&ctx, ports, 1);
+    vera_parse(&ctx);
+    vera_intern_strings(&ctx);
+    assert(riscv32_code_size(&ctx) > size);
+    vera_free_ctx(&ctx);
+}
+
+/* Writes a random program that terminates, trying the seeds from `*seed` */
+static void terminating_program(char *buffer, uint32_t *seed, unsigned int rule_count, unsigned int fact_count) {
+    for(;; (*seed)++) {
+        vera_ctx ctx;
+        vera_program prog;
+        random_program(buffer, *seed, rule_count, fact_count);
+        vera_init_ctx_arena(&ctx, buffer);
+        vera_parse(&ctx);
+        vera_intern_strings(&ctx);
+        vera_program_init(&prog, &ctx);
+        uint32_t registers[ctx.register_count];
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            registers[j] = 0;
+        vera_fill_registers(&ctx, registers);
+        const uint32_t fuel = 100000, firings = vera_run(&prog, registers, fuel);
+        vera_program_free(&prog);
+        vera_free_ctx(&ctx);
+        if(firings < fuel)
+            break;
+    }
+    (*seed)++;
+}
+
+/* Independent programs, with their own fact names, put one after the other */
+void test_parallel(void) {
+    const unsigned int program_count = 6, rule_count = 20;
+    char *src = (char*)malloc(64 * rule_count * program_count), *p;
+    uint32_t seed = 1;
+    for(unsigned int iteration = 0; iteration < 4; iteration++) {
+        vera_ctx ctx;
+        vera_program prog;
+        vera_partition part;
+        p = src;
+        for(unsigned int n = 0; n < program_count; n++) {
+            terminating_program(p, &seed, rule_count, 12);
+            for(; *p; p++) {
+                if(*p == 'f')
+                    *p = 'a' + n;
+            }
+            *p++ = '\n';
+        }
+        *p = '\0';
+        vera_init_ctx_arena(&ctx, src);
+        vera_parse(&ctx);
+        vera_intern_strings(&ctx);
+        vera_program_init(&prog, &ctx);
+        vera_partition_init(&part, &prog);
+        assert(prog.rule_count == program_count * rule_count);
+        assert(part.component_count >= program_count);
+        /* a component never mixes two programs */
+        unsigned int program[part.component_count];
+        for(unsigned int rule = prog.rule_count; rule-- > 0;)
+            program[part.rule_component[rule]] = rule / rule_count;
+        for(unsigned int rule = 0; rule < prog.rule_count; rule++)
+            assert(program[part.rule_component[rule]] == rule / rule_count);
+        uint32_t expected[ctx.register_count], registers[ctx.register_count];
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            expected[j] = registers[j] = 0;
+        vera_fill_registers(&ctx, expected);
+        vera_fill_registers(&ctx, registers);
+        assert(vera_verify_parallel(&prog, &part, registers, 0, 3) == VERA_VERIFY_SAME);
+        const uint32_t firings = vera_run(&prog, expected, 0);
+        printf("%u firings in %u components\n", firings, part.component_count);
+        assert(vera_run_parallel(&part, registers, 0, 4) == firings);
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            assert(registers[j] == expected[j]);
+        vera_partition_free(&part);
+        vera_program_free(&prog);
+        vera_free_ctx(&ctx);
+    }
+    free(src);
+}
+
+/* Rules that only read constants are alone in their components, which outnumber the registers */
+void test_parallel_small(void) {
+    vera_ctx ctx;
+    vera_program prog;
+    vera_partition part;
+    vera_init_ctx_arena(&ctx, "|| a\n|a?, b?|\n|a?, b?|\n|a?, b?|\n|a?, b?|\n|a?, b?|\n|a?, b?|");
+    vera_parse(&ctx);
+    vera_intern_strings(&ctx);
+    vera_program_init(&prog, &ctx);
+    vera_partition_init(&part, &prog);
+    assert(part.component_count > prog.register_count);
+    uint32_t registers[ctx.register_count];
+    for(unsigned int j = 0; j < ctx.register_count; j++)
+        registers[j] = 0;
+    vera_fill_registers(&ctx, registers);
+    assert(vera_verify_parallel(&prog, &part, registers, 0, 2) == VERA_VERIFY_SAME);
+    vera_partition_free(&part);
+    vera_program_free(&prog);
+    vera_free_ctx(&ctx);
+}
+
+/* With fuel, a program that loops can't be verified, and one that stops within it can */
+void test_verify_fuel(void) {
+    static const char *srcs[] = { "|| a\n|a|b\n|b|a", "|| a\n|a|b\n|b|c" };
+    static const int results[] = { VERA_VERIFY_INCONCLUSIVE, VERA_VERIFY_SAME };
+    for(size_t n = 0; n < sizeof(srcs) / sizeof(srcs[0]); n++) {
+        vera_ctx ctx;
+        vera_program prog;
+        vera_partition part;
+        vera_init_ctx_arena(&ctx, srcs[n]);
+        vera_parse(&ctx);
+        vera_intern_strings(&ctx);
+        vera_program_init(&prog, &ctx);
+        vera_partition_init(&part, &prog);
+        uint32_t registers[ctx.register_count];
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            registers[j] = 0;
+        vera_fill_registers(&ctx, registers);
+        assert(vera_verify_parallel(&prog, &part, registers, 100, 2) == results[n]);
+        vera_partition_free(&part);
+        vera_program_free(&prog);
+        vera_free_ctx(&ctx);
+    }
+}
+
+/* A parameter sweep : each instance starts from the seeds plus a few counters of its own */
+void test_batch(void) {
+    const unsigned int rule_count = 500, instance_count = 13;
+    const size_t sample_count = sizeof(samples) / sizeof(samples[0]);
+    char *src = (char*)malloc(64 * rule_count);
+    /* the samples stop before the fuel runs out, the random programs usually don't */
+    for(size_t n = 0; n < sample_count + 4; n++) {
+        vera_ctx ctx;
+        vera_program prog;
+        vera_batch batch;
+        if(n < sample_count)
+            strcpy(src, samples[n]);
+        else
+            random_program(src, n - sample_count + 1, rule_count, 40);
+        vera_init_ctx_arena(&ctx, src);
+        vera_parse(&ctx);
+        vera_intern_strings(&ctx);
+        vera_program_init(&prog, &ctx);
+        vera_batch_init(&batch, &prog, instance_count);
+        uint32_t expected[instance_count][ctx.register_count], registers[ctx.register_count];
+        uint32_t firings[instance_count];
+        for(unsigned int i = 0; i < instance_count; i++) {
+            for(unsigned int j = 0; j < ctx.register_count; j++)
+                expected[i][j] = (i * 7 + j) % 5 == 0 ? i : 0;
+            vera_fill_registers(&ctx, expected[i]);
+            vera_batch_set(&batch, i, expected[i]);
+            firings[i] = vera_run(&prog, expected[i], 300);
+        }
+        vera_batch_run(&batch, 300);
+        for(unsigned int i = 0; i < instance_count; i++) {
+            vera_batch_get(&batch, i, registers);
+            assert(batch.firings[i] == firings[i]);
+            for(unsigned int j = 0; j < ctx.register_count; j++)
+                assert(registers[j] == expected[i][j]);
+        }
+        vera_batch_free(&batch);
+        vera_program_free(&prog);
+        vera_free_ctx(&ctx);
+    }
+    free(src);
+}
+
+/* Big enough for the jumps back to the first rule to need more than a jal, the branches to the
+   end of the program to be relaxed, and most counters to be out of reach of the base register */
+void test_riscv32_large(void) {
+    const unsigned int rule_count = 20000;
+    const uint32_t fuel = 200;
+    char *src = (char*)malloc(64 * rule_count);
+    vera_ctx ctx;
+    vera_program prog;
+    random_program(src, 7, rule_count, 2000);
+    vera_init_ctx_arena(&ctx, src);
+    vera_parse(&ctx);
+    vera_intern_strings(&ctx);
+    vera_program_init(&prog, &ctx);
+    uint32_t *expected = (uint32_t*)calloc(ctx.register_count, sizeof(uint32_t));
+    uint32_t *registers = (uint32_t*)malloc(ctx.register_count * sizeof(uint32_t));
+    vera_fill_registers(&ctx, expected);
+    uint32_t firings = vera_run(&prog, expected, fuel);
+    printf("%u firings, %zu bytes of code\n", firings, vera_riscv32_codegen(&ctx, NULL, 0));
+    assert(run_riscv32_fuel(&ctx, registers, 1, fuel, 0) == firings);
+    for(unsigned int j = 0; j < ctx.register_count; j++)
+        assert(registers[j] == expected[j]);
+    free(expected);
+    free(registers);
+    vera_program_free(&prog);
+    vera_free_ctx(&ctx);
+    free(src);
+}
+
+#ifdef VERA_X86_64
+void test_x86_64(void) {
+    for(size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        vera_ctx ctx;
+        vera_x86_64_code code;
+        vera_init_ctx_arena(&ctx, samples[i]);
+        vera_parse(&ctx);
+        vera_intern_strings(&ctx);
+        uint32_t expected[ctx.register_count], registers[ctx.register_count];
+        run_riscv32(&ctx, expected, 0);
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            registers[j] = 0;
+        vera_fill_registers(&ctx, registers);
+        vera_x86_64_codegen(&ctx, &code);
+        while(code.run(registers, 3) == 3)
+            ;
+        for(unsigned int j = 0; j < ctx.register_count; j++)
+            assert(registers[j] == expected[j]);
+        vera_x86_64_free(&code);
+        vera_free_ctx(&ctx);
+    }
+}
+#endif
+
+int main(void) {
+    test_scmp();
+    test_intern_strings();
+    test_parse_modes();
+    test_input_modes();
+    test_rv32_run();
+    test_rvc();
+    test_ring();
+    test_mmio();
+    test_ports();
+    test_compile_cache();
+    test_image();
+    test_rv32_batch();
+    test_profile();
+    test_interpreter();
+    test_incremental();
+    test_resume();
+    test_live();
+    test_batch();
+    test_parallel();
+    test_parallel_small();
+    test_verify_fuel();
+    test_riscv32_large();
+#ifdef VERA_X86_64
+    test_x86_64();
+#endif
+
     printf("OK\n");
     return 0;
-}
\ No newline at end of file
+}
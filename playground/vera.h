@@ -6,6 +6,7 @@
 #include <assert.h>
 
 #include <stdlib.h> /* for exit() */
+#include <string.h> /* for memset() and memcpy() */
 
 /* The parser in inspired by https://zserge.com/jsmn/ */
 
@@ -21,37 +22,243 @@ enum vera_obj_type {
     VERA_PORT,
 };
 
+/* Facts are stored as an offset and a length in the source,
+   ports as an index in the port list and the length of the name */
 typedef struct vera_object {
-    enum vera_obj_type type;
-    union {
-        struct {
-            vera_string vstr;
-            int intern;
-            union {
-                int keep;
-                unsigned int count;
-            } attr;
-        } fact;
-        struct {
-            vera_string vstr;
-            int intern;
-        } port;
-    } as;
+    uint32_t offset;
+    uint32_t len;
+    int32_t intern;
+    unsigned int type : 2; /* enum vera_obj_type */
+    unsigned int keep : 1; /* lhs facts only */
+    unsigned int count : 29; /* rhs facts only */
 } vera_obj;
 
+#define VERA_MAX_COUNT ((1u << 29) - 1)
+
+/* objects per arena chunk */
+#define VERA_CHUNK_SHIFT 12
+#define VERA_CHUNK_SIZE (1 << VERA_CHUNK_SHIFT)
+
 typedef struct {
     const char *src;
-    int pos;
+    size_t len; /* SIZE_MAX if the source is NUL terminated */
+    size_t pos;
     char delimiter;
-    vera_obj *pool;
+    const char **ports;
+    unsigned int port_count;
+    uint32_t port_mmio_base; /* 0 if the ports are plain counters in the generated code, see vera_port_io */
+    int profile; /* boolean, the generated code counts the firings of every rule, see vera_profile */
+    int rvc; /* boolean, the RISC-V code uses the compressed instructions where they fit (default) */
+    vera_obj *pool; /* provided by the caller, see vera_init_ctx */
     size_t pool_size;
+    int arena; /* boolean, see vera_init_ctx_arena */
+    vera_obj **chunks;
+    size_t chunk_count;
     unsigned int obj_count;
     unsigned int register_count;
+    char *buffer; /* source owned by the context, see vera_init_ctx_stream */
+    size_t buffer_size;
+    size_t buffer_capacity;
+    void *map; /* see vera_init_ctx_file */
+    size_t map_size;
 } vera_ctx;
 
 void vera_init_ctx(vera_ctx *ctx, const char *src, vera_obj *pool, size_t pool_size);
+void vera_init_ctx_arena(vera_ctx *ctx, const char *src);
+void vera_init_ctx_len(vera_ctx *ctx, const char *src, size_t len);
+void vera_init_ctx_file(vera_ctx *ctx, const char *path);
+void vera_init_ctx_stream(vera_ctx *ctx);
+void vera_feed(vera_ctx *ctx, const char *data, size_t len);
+void vera_free_ctx(vera_ctx *ctx);
+vera_obj *vera_get_obj(vera_ctx *ctx, size_t i);
+vera_string vera_obj_string(vera_ctx *ctx, vera_obj *obj);
 void vera_compile(vera_ctx *ctx);
 
+/* Rules lowered for all the backends : for every rule with a non empty lhs, the distinct
+   registers it reads and the net change of the registers it modifies (a fact of the lhs
+   without `?` counts for -1, so the keep flags and the rhs counts are folded together) */
+typedef struct {
+    unsigned int rule_count;
+    unsigned int register_count;
+    uint32_t *lhs_start; /* rule_count + 1 entries, indices in lhs */
+    uint32_t *lhs;
+    uint32_t *effect_start; /* rule_count + 1 entries, indices in effect_reg and effect_diff */
+    uint32_t *effect_reg;
+    int32_t *effect_diff;
+    uint32_t *readers_start; /* register_count + 1 entries, indices in readers */
+    uint32_t *readers; /* for every register, the rules that read it, in increasing order */
+    uint32_t *block_start; /* (rule_count + 63) / 64 + 1 entries, indices in block_reg and block_rules */
+    uint32_t *block_reg;
+    uint64_t *block_rules; /* for every register read in a block of 64 rules, the rules of the block that read it */
+    uint32_t *resume; /* for every rule, where the scan for the next rule to fire can start after it fired */
+} vera_program;
+
+void vera_fill_registers(vera_ctx *ctx, uint32_t *registers);
+void vera_program_init(vera_program *prog, vera_ctx *ctx);
+void vera_program_free(vera_program *prog);
+void vera_program_live(const vera_program *prog, const uint32_t *registers, const uint8_t *inputs, uint8_t *live);
+uint32_t vera_run(const vera_program *prog, uint32_t *registers, uint32_t max_firings);
+uint32_t vera_run_incremental(const vera_program *prog, uint32_t *registers, uint32_t max_firings);
+uint32_t vera_run_bitset(const vera_program *prog, uint32_t *registers, uint32_t max_firings);
+
+/* With ctx->profile, the generated code keeps two counters for every rule with a non empty lhs,
+   right after the registers : the number of times the rule fired, then the number of times
+   it was checked and didn't apply. Without it, the code is the same as before */
+typedef struct {
+    uint32_t line; /* of the rule in the source, from 1 */
+    uint64_t fired;
+    uint64_t rejected;
+} vera_rule_profile;
+
+typedef struct {
+    unsigned int rule_count;
+    vera_rule_profile *rules; /* in the order of the source */
+} vera_profile;
+
+void vera_profile_init(vera_profile *profile, vera_ctx *ctx);
+void vera_profile_add(vera_profile *profile, const uint32_t *counters);
+void vera_profile_free(vera_profile *profile);
+
+/* Instances of the same program run side by side : the counters are stored register by
+   register, the counter of register r for instance i being counters[r * stride + i] */
+typedef struct {
+    const vera_program *prog;
+    unsigned int instance_count;
+    unsigned int stride; /* instance_count rounded up to VERA_BATCH_LANES */
+    uint32_t *counters;
+    uint32_t *firings; /* per instance, set by vera_batch_run */
+} vera_batch;
+
+void vera_batch_init(vera_batch *batch, const vera_program *prog, unsigned int instance_count);
+void vera_batch_free(vera_batch *batch);
+void vera_batch_set(vera_batch *batch, unsigned int instance, const uint32_t *registers);
+void vera_batch_get(const vera_batch *batch, unsigned int instance, uint32_t *registers);
+void vera_batch_run(vera_batch *batch, uint32_t max_firings);
+
+/* Rules that share no register written by one of them commute : the program splits into
+   components that don't interact, and that can be run to completion separately */
+typedef struct {
+    unsigned int component_count;
+    uint32_t *rule_component; /* the component of every rule */
+    vera_program *components; /* the rules of every component, in program order */
+} vera_partition;
+
+void vera_partition_init(vera_partition *part, const vera_program *prog);
+void vera_partition_free(vera_partition *part);
+uint32_t vera_run_parallel(const vera_partition *part, uint32_t *registers, uint32_t max_firings, unsigned int thread_count);
+
+enum vera_verify_result {
+    VERA_VERIFY_DIFFERENT,
+    VERA_VERIFY_SAME,
+    VERA_VERIFY_INCONCLUSIVE, /* one of the runs used up its fuel */
+};
+
+int vera_verify_parallel(const vera_program *prog, const vera_partition *part, const uint32_t *registers,
+                         uint32_t max_firings, unsigned int thread_count);
+
+/* Single producer, single consumer ring of 32 bits values, without locks. `head` and `tail`
+   count the values written and read since the beginning, the capacity is a power of two */
+typedef struct {
+    uint32_t *data;
+    uint32_t capacity;
+    uint32_t head; /* written by the producer only */
+    uint32_t tail; /* written by the consumer only */
+} vera_ring;
+
+void vera_ring_init(vera_ring *ring, uint32_t capacity);
+void vera_ring_free(vera_ring *ring);
+uint32_t vera_ring_writable(vera_ring *ring, uint32_t **values);
+void vera_ring_commit(vera_ring *ring, uint32_t count);
+uint32_t vera_ring_readable(vera_ring *ring, const uint32_t **values);
+void vera_ring_consume(vera_ring *ring, uint32_t count);
+uint32_t vera_ring_write(vera_ring *ring, const uint32_t *values, uint32_t count);
+uint32_t vera_ring_read(vera_ring *ring, uint32_t *values, uint32_t count);
+
+/* Host side of the ports of a program compiled with a non zero ctx->port_mmio_base.
+   Port i is mapped at port_mmio_base + 8 i : the host writes increments of the port counter
+   in in[i], and reads from out[i] the increments made by the rules */
+#define VERA_PORT_MMIO_SIZE(port_count) (8 * (port_count))
+
+typedef struct {
+    unsigned int port_count;
+    vera_ring *in;
+    vera_ring *out;
+    uint32_t *pending; /* increments that didn't fit in out, owned by the program side */
+} vera_port_io;
+
+void vera_port_io_init(vera_port_io *io, unsigned int port_count, uint32_t capacity);
+void vera_port_io_free(vera_port_io *io);
+int vera_port_io_load(vera_port_io *io, uint32_t offset, uint32_t *value);
+int vera_port_io_store(vera_port_io *io, uint32_t offset, uint32_t value);
+int vera_port_io_flush(vera_port_io *io);
+
+#ifdef VERA_RISCV32
+#define VERA_RISCV32_PAGE_SIZE 4096
+
+size_t vera_riscv32_codegen(vera_ctx *ctx, uint8_t *output, size_t max_size);
+
+#define VERA_IMAGE_MAGIC 0x41524556u /* "VERA" */
+#define VERA_IMAGE_VERSION 1u
+/* Part of the key of the compile cache, apart from the file format : bumped by every change of
+   the code generated for the same source and options */
+#define VERA_CODEGEN_REVISION 6u
+
+/* Header of the file written by vera_riscv32_image. The code and data sections are page aligned
+   in the file and in the guest memory, so that they can be mapped (see rv32_load_image, which
+   reads the fields up to data_size : they don't change from one version to the next).
+   The data section holds the registers, 4 bytes each, and the string table their names */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry; /* guest address of the first instruction */
+    uint32_t code_offset, code_addr, code_size;
+    uint32_t data_offset, data_addr, data_size;
+    uint32_t halt; /* guest address of the ebreak */
+    uint32_t register_count;
+    uint32_t port_count; /* the ports are the first registers */
+    uint32_t port_mmio_base;
+    uint32_t strings_offset, strings_size; /* register_count NUL terminated names, in register order */
+    uint32_t profile_count; /* rules with counters after the registers, see vera_profile */
+    uint64_t source_hash; /* of the source, the ports and the options */
+} vera_image_header;
+
+size_t vera_riscv32_image(vera_ctx *ctx, uint8_t **image);
+int vera_image_check(const uint8_t *image, size_t size);
+const char *vera_image_name(const uint8_t *image, unsigned int j);
+
+/* Compiled program, from the compile cache or fresh */
+typedef struct {
+    const uint8_t *image; /* the output of vera_riscv32_image */
+    size_t image_size;
+    const uint8_t *code; /* the guest memory from address 0, the registers are its last words */
+    uint32_t code_size;
+    uint32_t register_count;
+    const char *names; /* register_count NUL terminated fact names, in register order */
+    void *map; /* the cached file, if it could be mapped */
+    size_t map_size;
+    void *buffer; /* otherwise, a copy owned by the artifact */
+} vera_artifact;
+
+int vera_riscv32_compile_cached(const char *cache_dir, vera_ctx *ctx, vera_artifact *artifact);
+void vera_artifact_free(vera_artifact *artifact);
+#endif
+
+#ifdef VERA_X86_64
+typedef uint32_t (*vera_x86_64_fn)(uint32_t *registers, uint32_t fuel);
+
+/* Like the RISC-V code, the generated function fires rules on `registers` until none
+   applies or `fuel` rules have been fired (no limit if `fuel` is 0),
+   and returns the number of firings. With ctx->profile, `registers` is followed by the counters */
+typedef struct {
+    vera_x86_64_fn run;
+    void *code; /* executable mapping */
+    size_t size;
+} vera_x86_64_code;
+
+void vera_x86_64_codegen(vera_ctx *ctx, vera_x86_64_code *code);
+void vera_x86_64_free(vera_x86_64_code *code);
+#endif
+
 #ifdef VERA_IMPLEMENTATION
 
 #define ERROR(...) \
@@ -62,13 +269,156 @@ void vera_compile(vera_ctx *ctx);
         exit(1); \
     } while(0)
 
+/* Two pass mode : call vera_parse a first time with `pool` == NULL to count the objects,
+   then allocate the pool and parse again */
 void vera_init_ctx(vera_ctx *ctx, const char *src, vera_obj *pool, size_t pool_size) {
     ctx->src = src;
+    ctx->len = SIZE_MAX;
     ctx->pos = 0;
     ctx->delimiter = 0;
+    ctx->ports = NULL;
+    ctx->port_count = 0;
+    ctx->port_mmio_base = 0;
+    ctx->profile = 0;
+    ctx->rvc = 1;
     ctx->pool = pool;
     ctx->pool_size = pool_size;
+    ctx->arena = 0;
+    ctx->chunks = NULL;
+    ctx->chunk_count = 0;
     ctx->obj_count = 0;
+    ctx->register_count = 0;
+    ctx->buffer = NULL;
+    ctx->buffer_size = 0;
+    ctx->buffer_capacity = 0;
+    ctx->map = NULL;
+    ctx->map_size = 0;
+}
+
+/* Single pass mode : the objects are stored in chunks owned by the context,
+   they are released by vera_free_ctx */
+void vera_init_ctx_arena(vera_ctx *ctx, const char *src) {
+    vera_init_ctx(ctx, src, NULL, 0);
+    ctx->arena = 1;
+}
+
+/* Single pass mode on the `len` first bytes of `src`, which doesn't need to be NUL terminated */
+void vera_init_ctx_len(vera_ctx *ctx, const char *src, size_t len) {
+    vera_init_ctx_arena(ctx, src);
+    ctx->len = len;
+}
+
+/* Chunked mode : the source is given piece by piece to vera_feed, and copied in a buffer owned by
+   the context. The rules are parsed as soon as they are complete, vera_parse parses the last one */
+void vera_init_ctx_stream(vera_ctx *ctx) {
+    vera_init_ctx_len(ctx, NULL, 0);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Single pass mode on a file, mapped read-only rather than copied. It stays mapped until vera_free_ctx */
+void vera_init_ctx_file(vera_ctx *ctx, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        ERROR("can't open %s", path);
+    if(fstat(fd, &st) < 0)
+        ERROR("can't stat %s", path);
+    vera_init_ctx_len(ctx, NULL, 0);
+    if(st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map == MAP_FAILED)
+            ERROR("can't map %s", path);
+        ctx->map = map;
+        ctx->map_size = st.st_size;
+        ctx->src = (const char*)map;
+        ctx->len = st.st_size;
+    }
+    close(fd);
+}
+#else
+/* Without mmap, the file is read into the buffer of the chunked mode */
+void vera_init_ctx_file(vera_ctx *ctx, const char *path) {
+    char chunk[4096];
+    size_t n;
+    FILE *f = fopen(path, "rb");
+    if(!f)
+        ERROR("can't open %s", path);
+    vera_init_ctx_stream(ctx);
+    while((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        vera_feed(ctx, chunk, n);
+    if(ferror(f))
+        ERROR("can't read %s", path);
+    fclose(f);
+}
+#endif
+
+void vera_free_ctx(vera_ctx *ctx) {
+    for(size_t i = 0; i < ctx->chunk_count; i++)
+        free(ctx->chunks[i]);
+    free(ctx->chunks);
+    ctx->chunks = NULL;
+    ctx->chunk_count = 0;
+    free(ctx->buffer);
+    ctx->buffer = NULL;
+#if defined(__unix__) || defined(__APPLE__)
+    if(ctx->map)
+        munmap(ctx->map, ctx->map_size);
+#endif
+    ctx->map = NULL;
+}
+
+vera_obj *vera_get_obj(vera_ctx *ctx, size_t i) {
+    if(ctx->arena)
+        return &ctx->chunks[i >> VERA_CHUNK_SHIFT][i & (VERA_CHUNK_SIZE - 1)];
+    return &ctx->pool[i];
+}
+
+vera_string vera_obj_string(vera_ctx *ctx, vera_obj *obj) {
+    vera_string vstr;
+    if(obj->type == VERA_PORT)
+        vstr.string = ctx->ports[obj->offset];
+    else
+        vstr.string = &ctx->src[obj->offset];
+    vstr.len = obj->len;
+    return vstr;
+}
+
+/* Returns NULL during the first pass of the two pass mode */
+static vera_obj *vera_new_obj(vera_ctx *ctx) {
+    vera_obj *obj;
+    if(ctx->arena) {
+        const size_t chunk = ctx->obj_count >> VERA_CHUNK_SHIFT;
+        if(chunk >= ctx->chunk_count) {
+            vera_obj **chunks = (vera_obj**)realloc(ctx->chunks, (chunk + 1) * sizeof(vera_obj*));
+            if(!chunks)
+                ERROR("out of memory");
+            ctx->chunks = chunks;
+            ctx->chunks[chunk] = (vera_obj*)malloc(VERA_CHUNK_SIZE * sizeof(vera_obj));
+            if(!ctx->chunks[chunk])
+                ERROR("out of memory");
+            ctx->chunk_count = chunk + 1;
+        }
+        obj = &ctx->chunks[chunk][ctx->obj_count & (VERA_CHUNK_SIZE - 1)];
+    } else if(ctx->pool == NULL) { /* if we do a first pass to calculate the needed pool size */
+        ctx->obj_count++;
+        return NULL;
+    } else {
+        if(ctx->obj_count >= ctx->pool_size)
+            ERROR("out of memory");
+        obj = &ctx->pool[ctx->obj_count];
+    }
+    ctx->obj_count++;
+    obj->offset = 0;
+    obj->len = 0;
+    obj->intern = -1;
+    obj->keep = 0;
+    obj->count = 0;
+    return obj;
 }
 
 static int vera_scmp(vera_string *s1, vera_string *s2) {
@@ -112,61 +462,52 @@ size_t slen(const char *str) {
     return res;
 }
 
-static void vera_add_port(vera_ctx *ctx, const char *name) {
-    if(ctx->pool == NULL) { /* if we do a first pass to calculate the needed pool size */
-        ctx->obj_count++;
+static void vera_add_port(vera_ctx *ctx, unsigned int index) {
+    vera_obj *obj = vera_new_obj(ctx);
+    if(obj == NULL)
         return;
-    }
-    if(ctx->obj_count >= ctx->pool_size)
-        ERROR("out of memory");
-    vera_obj *obj = &ctx->pool[ctx->obj_count];
     obj->type = VERA_PORT;
-    obj->as.port.vstr.string = name;
-    obj->as.port.vstr.len = slen(name);
-    obj->as.port.intern = -1;
-    ctx->obj_count++;
+    obj->offset = index;
+    obj->len = slen(ctx->ports[index]);
 }
 
-/* Make sure that `name` stays valid during the whole compilation */
+/* Make sure that `ports` and the names stay valid during the whole compilation.
+   Must be called at most once, before vera_parse */
 void vera_add_ports(vera_ctx *ctx, const char **ports, size_t port_count) {
+    if(ctx->ports)
+        ERROR("ports already added");
+    ctx->ports = ports;
+    ctx->port_count = port_count;
     for(size_t i = 0; i < port_count; i++)
-        vera_add_port(ctx, ports[i]);
+        vera_add_port(ctx, i);
 }
 
 static void vera_add_side(vera_ctx *ctx, enum vera_obj_type type) {
-    if(ctx->pool == NULL) { /* if we do a first pass to calculate the needed pool size */
-        ctx->obj_count++;
+    vera_obj *obj = vera_new_obj(ctx);
+    if(obj == NULL)
         return;
-    }
-    const int obj_id = ctx->obj_count;
-    if(obj_id >= ctx->pool_size)
-        ERROR("out of memory");
-    ctx->pool[obj_id].type = type;
-    ctx->obj_count++;
+    obj->type = type;
 }
 
-static void vera_add_fact(vera_ctx *ctx, vera_string vstr, enum vera_obj_type side, int keep, unsigned int count) {
-    if(ctx->pool == NULL) { /* if we do a first pass to calculate the needed pool size */
-        ctx->obj_count++;
+static void vera_add_fact(vera_ctx *ctx, size_t start, size_t end, enum vera_obj_type side, int keep, unsigned int count) {
+    if(end > UINT32_MAX)
+        ERROR("source too large");
+    vera_obj *obj = vera_new_obj(ctx);
+    if(obj == NULL)
         return;
-    }
-    if(ctx->obj_count >= ctx->pool_size)
-        ERROR("out of memory");
-    vera_obj *obj = &ctx->pool[ctx->obj_count];
     obj->type = VERA_FACT;
-    obj->as.fact.vstr = vstr;
-    obj->as.fact.intern = -1;
+    obj->offset = start;
+    obj->len = end - start;
     if(side == VERA_LHS) {
-        obj->as.fact.attr.keep = keep;
+        obj->keep = keep;
     } else if(side == VERA_RHS) {
-        obj->as.fact.attr.count = count;
+        obj->count = count;
     } else {
         ERROR("unreachable");
     }
-    ctx->obj_count++;
 }
 
-#define CURSOR (ctx->src[ctx->pos])
+#define CURSOR (ctx->pos < ctx->len ? ctx->src[ctx->pos] : '\0')
 #define DELIM (ctx->delimiter)
 
 static void vera_advance(vera_ctx *ctx) {
@@ -197,43 +538,41 @@ static int vera_is_in(char c, const char *set) {
 }
 
 static int vera_int(vera_ctx *ctx) {
-    int start = ctx->pos;
+    size_t start = ctx->pos;
     if(!isdigit(CURSOR)) ERROR("expected digit");
     while(isdigit(CURSOR))
         vera_advance(ctx);
-    int end = ctx->pos;
+    size_t end = ctx->pos;
     int n = 0;
-    for(int i = start; i < end; i++)
+    for(size_t i = start; i < end; i++)
         n = 10 * n + ctx->src[i] - '0';
     return n;
 }
 
 static void vera_fact(vera_ctx *ctx, enum vera_obj_type side) {
-    int start = ctx->pos;
+    size_t start = ctx->pos;
     if(vera_is_in(CURSOR, " ?:,") || CURSOR == DELIM)
         ERROR("unexpected `%c`", CURSOR);
     while(CURSOR && !vera_is_in(CURSOR, "?:,") && CURSOR != DELIM)
         vera_advance(ctx);
-    int end = ctx->pos;
+    size_t end = ctx->pos;
     if(end <= start) ERROR("empty string");
-    vera_string vstr;
-    vstr.string = &ctx->src[start];
-    vstr.len = end - start;
     if(side == VERA_LHS) {
         int keep = 0;
         if(CURSOR == '?') {
             vera_advance(ctx);
             keep = 1;
         }
-        vera_add_fact(ctx, vstr, VERA_LHS, keep, 0);
+        vera_add_fact(ctx, start, end, VERA_LHS, keep, 0);
     } else if(side == VERA_RHS) {
         int count = 1;
         if(CURSOR == ':') {
             vera_advance(ctx);
             vera_skipspace(ctx);
             count = vera_int(ctx);
+            if(count > VERA_MAX_COUNT) ERROR("count too large");
         }
-        vera_add_fact(ctx, vstr, VERA_RHS, 0, count);
+        vera_add_fact(ctx, start, end, VERA_RHS, 0, count);
     } else {
         ERROR("unreachable");
     }
@@ -242,7 +581,7 @@ static void vera_fact(vera_ctx *ctx, enum vera_obj_type side) {
 static void vera_side(vera_ctx *ctx, enum vera_obj_type side) {
     if(side == VERA_FACT) ERROR("unreachable");
     vera_add_side(ctx, side);
-    if(CURSOR == DELIM)
+    if(CURSOR == DELIM || CURSOR == '\0')
         return;
     vera_fact(ctx, side);
     vera_skipspace(ctx);
@@ -264,12 +603,61 @@ static void vera_rule(vera_ctx *ctx) {
     vera_side(ctx, VERA_RHS);
 }
 
+/* A rule ends where the next one starts, so the rules before the third delimiter from the cursor
+   are complete. They are parsed with the source cut just after that delimiter */
+static void vera_parse_complete_rules(vera_ctx *ctx) {
+    const size_t size = ctx->buffer_size;
+    ctx->len = size;
+    if(!DELIM) {
+        vera_skipspace(ctx);
+        if(!CURSOR)
+            return;
+        DELIM = CURSOR;
+    }
+    while(CURSOR == DELIM) {
+        size_t end = ctx->pos;
+        int delimiters = 0;
+        while(end < size && delimiters < 3) {
+            if(ctx->src[end++] == DELIM)
+                delimiters++;
+        }
+        if(delimiters < 3)
+            break;
+        ctx->len = end;
+        vera_rule(ctx);
+        vera_skipspace(ctx);
+        ctx->len = size;
+    }
+}
+
+/* The buffer is reallocated as it grows, the objects only keep offsets into it */
+void vera_feed(vera_ctx *ctx, const char *data, size_t len) {
+    if(ctx->buffer_size + len > ctx->buffer_capacity) {
+        size_t capacity = ctx->buffer_capacity ? ctx->buffer_capacity : 4096;
+        while(capacity < ctx->buffer_size + len)
+            capacity *= 2;
+        char *buffer = (char*)realloc(ctx->buffer, capacity);
+        if(!buffer)
+            ERROR("out of memory");
+        ctx->buffer = buffer;
+        ctx->buffer_capacity = capacity;
+    }
+    memcpy(ctx->buffer + ctx->buffer_size, data, len);
+    ctx->buffer_size += len;
+    ctx->src = ctx->buffer;
+    vera_parse_complete_rules(ctx);
+}
+
 size_t vera_parse(vera_ctx *ctx) {
+    if(ctx->buffer)
+        ctx->len = ctx->buffer_size; /* everything that has been fed */
     vera_skipspace(ctx);
-    if(CURSOR)
-        DELIM = CURSOR;
-    else
-        ERROR("empty source");
+    if(!DELIM) {
+        if(CURSOR)
+            DELIM = CURSOR;
+        else
+            ERROR("empty source");
+    }
     while(CURSOR == DELIM) {
         vera_rule(ctx);
         vera_skipspace(ctx);
@@ -281,114 +669,86 @@ size_t vera_parse(vera_ctx *ctx) {
 #undef DELIM
 
 
-/* helper function for vera_intern_strings */
-static int vera_find_string(vera_ctx *ctx, vera_string *vstr) {
-    for(size_t i = 0; i < ctx->obj_count; i++) {
-        vera_obj *obj = &ctx->pool[i];
-        if(obj->type == VERA_FACT) {
-            if(obj->as.fact.intern < 0)
-                return -1;
-            if(vera_scmp(&obj->as.fact.vstr, vstr))
-                return obj->as.fact.intern;
-        } else if(obj->type == VERA_PORT) {
-            if(obj->as.port.intern < 0)
-                return -1;
-            if(vera_scmp(&obj->as.port.vstr, vstr))
-                return obj->as.port.intern;
+/* helper types and functions for vera_intern_strings */
+
+typedef struct {
+    vera_string vstr;
+    uint32_t hash;
+    int intern; /* -1 if the slot is empty */
+} vera_intern_entry;
+
+/* FNV-1a hash of the string as vera_scmp sees it : leading and trailing spaces are ignored,
+   and every run of spaces is hashed as a single ' ' */
+static uint32_t vera_shash(vera_string *vstr) {
+    size_t i = 0, len = vstr->len;
+    uint32_t hash = 2166136261u;
+    while(i < len && isspace(vstr->string[i]))
+        i++;
+    while(len > i && isspace(vstr->string[len - 1]))
+        len--;
+    while(i < len) {
+        unsigned char c = vstr->string[i];
+        if(isspace(c)) {
+            c = ' ';
+            while(i < len && isspace(vstr->string[i]))
+                i++;
+        } else {
+            i++;
         }
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+static int vera_intern(vera_intern_entry *table, size_t capacity, vera_string *vstr, int *n) {
+    const uint32_t hash = vera_shash(vstr);
+    size_t slot = hash & (capacity - 1);
+    for(;;) {
+        vera_intern_entry *entry = &table[slot];
+        if(entry->intern < 0) {
+            entry->vstr = *vstr;
+            entry->hash = hash;
+            entry->intern = (*n)++;
+            return entry->intern;
+        }
+        if(entry->hash == hash && vera_scmp(&entry->vstr, vstr))
+            return entry->intern;
+        slot = (slot + 1) & (capacity - 1);
     }
-    return -1;
 }
 
+/* Interned indices are given in order of first appearance in the pool */
 void vera_intern_strings(vera_ctx *ctx) {
     int n = 0;
+    size_t capacity = 16;
+    while(capacity < 2 * (size_t)ctx->obj_count)
+        capacity *= 2;
+    vera_intern_entry *table = (vera_intern_entry*)malloc(capacity * sizeof(vera_intern_entry));
+    if(!table)
+        ERROR("out of memory");
+    for(size_t i = 0; i < capacity; i++)
+        table[i].intern = -1;
     for(size_t i = 0; i < ctx->obj_count; i++) {
-        vera_obj *obj = &ctx->pool[i];
-        if(obj->type == VERA_FACT) {
-            int intern = vera_find_string(ctx, &obj->as.fact.vstr);
-            if(intern == -1)
-                obj->as.fact.intern = n++;
-            else
-                obj->as.fact.intern = intern;
-        } else if(obj->type == VERA_PORT) {
-            int intern = vera_find_string(ctx, &obj->as.port.vstr);
-            if(intern == -1)
-                obj->as.port.intern = n++;
-            else
-                obj->as.port.intern = intern;
+        vera_obj *obj = vera_get_obj(ctx, i);
+        if(obj->type == VERA_FACT || obj->type == VERA_PORT) {
+            vera_string vstr = vera_obj_string(ctx, obj);
+            obj->intern = vera_intern(table, capacity, &vstr, &n);
         }
     }
+    free(table);
     ctx->register_count = n;
 }
 
-#ifdef VERA_RISCV32
-
-
-#define emit(instr) \
-    do { \
-        *(uint32_t*)&output[pc] = instr; \
-        pc += 4; \
-    } while(0)
-#define I_type(opcode, funct3, rd, rs, imm) emit((opcode) | (funct3) << 12 | ((rd) & 0x1f) << 7 | ((rs) & 0x1f) << 15 | ((imm) & 0xfff) << 20)
-#define rv_addi(rd, rs, imm) I_type(0x13, 0, rd, rs, imm)
-#define rv_jal(reg, imm) emit(0x6f | (reg) << 7 | ((imm) & 0xff000) | ((imm) & (1 << 11)) << 9 | ((imm) & 0x7fe) << (21 - 1) | ((imm) & (1 << 20)) << 10)
-#define rv_jalr(rd, rs, imm) I_type(0x67, 0, rd, rs, imm)
-#define U_type(opcode, rd, imm) emit((opcode) | ((rd) & 0x1f) << 7 | ((imm) & 0xfffff) << 12)
-#define rv_lui(rd, imm) U_type(0x37, (rd), (imm))
-#define rv_auipc(rd, imm) U_type(0x17, (rd), (imm))
-#define rv_lw(rd, rs, imm) I_type(0x3, 0x2, rd, rs, imm)
-#define S_type(opcode, funct3, rs1, rs2, imm) emit((opcode) | ((imm) & 0x1f) << 7 | (funct3) << 12 | ((rs1) & 0x1f) << 15 | ((rs2) & 0x1f) << 20 | (((imm) & 0xfe0) << 20))
-#define rv_sw(rs1, rs2, imm) S_type(0x23, 0x2, rs1, rs2, imm)
-#define B_type(opcode, funct3, rs1, rs2, imm) emit((opcode) | (funct3) << 12 | (((imm) >> 11) & 0x1) << 7 | (((imm) >> 1) & 0xf) << 8 | ((rs1) & 0x1f) << 15 | ((rs2) & 0x1f) << 20 | (((imm) >> 5) & 0x1f) << 25 | (((imm) >> 12) & 0x1f) << 31)
-#define rv_bgeu(rs1, rs2, imm) B_type(0x63, 0x7, rs1, rs2, imm)
-#define rv_beq(rs1, rs2, imm) B_type(0x63, 0x0, rs1, rs2, imm)
-#define R_type(opcode, funct3, funct7, rd, rs1, rs2) emit((opcode) | ((rd) & 0x1f) << 7 | (funct3) << 12 | ((rs1) & 0x1f) << 15 | ((rs2) & 0x1f) << 20 | funct7 << 25)
-#define rv_add(rd, rs1, rs2) R_type(0x33, 0, 0, rd, rs1, rs2)
-#define rv_mul(rd, rs1, rs2) R_type(0x33, 0, 0x1, rd, rs1, rs2)
-#define rv_break() I_type(0x73, 0x0, 0, 0, 1)
-/* pseudo instructions */
-#define rv_b(addr) rv_jal(0, addr - pc)
-#define rv_ret() rv_jalr(zero, ra, 0)
-#define rv_li(rd, imm) rv_addi(rd, zero, imm)
-/* my own pseudo instructions */
-#define rv_load(rd, addr) \
-    do { \
-        int32_t offset = addr - pc; \
-        int32_t upper = (offset / (1 << 12)), lower = offset - upper; \
-        assert(lower < 1 << 12); \
-        printf("load addr = %d, pc = %u, offset = %d, upper = 0x%x, lower=0x%x\n", addr, pc, offset, upper, lower); \
-        rv_auipc(rd, upper); \
-        rv_lw(rd, rd, lower); \
-    } while(0)
-#define rv_store(data_reg, temp_reg, addr) \
-    do { \
-        int32_t offset = addr - pc; \
-        int32_t upper = (offset / (1 << 12)), lower = offset - upper; \
-        assert(lower < 1 << 12); \
-        printf("store addr = %d, pc = %u, offset = %d, upper = 0x%x, lower=0x%x\n", addr, pc, offset, upper, lower); \
-        rv_auipc(temp_reg, upper); \
-        rv_sw(temp_reg, data_reg, lower); \
-    } while(0)
-#define rv_load_i32_imm(rd, imm) \
-    do { \
-        int32_t upper = (imm) / (1 << 12), lower = (imm) - upper; \
-        assert(lower < 1 << 12); \
-        if(upper != 0) \
-            rv_lui((rd), upper); \
-        rv_li((rd), lower); \
-    } while(0)
-
-
 #define SKIP_PORTS() \
     do { \
-        while(i < ctx->obj_count && ctx->pool[i].type == VERA_PORT) \
+        while(i < ctx->obj_count && vera_get_obj(ctx, i)->type == VERA_PORT) \
             i++; \
     } while(0)
 
 #define SKIP_RULE() \
     do { \
         i++; \
-        while(i < ctx->obj_count && ctx->pool[i].type != VERA_LHS) \
+        while(i < ctx->obj_count && vera_get_obj(ctx, i)->type != VERA_LHS) \
             i++; \
     } while(0)
 
@@ -397,7 +757,7 @@ void vera_intern_strings(vera_ctx *ctx) {
         for(;;) { \
             if(i >= ctx->obj_count - 1) \
                 break; \
-            vera_obj *obj1 = &ctx->pool[i], *obj2 = &ctx->pool[i+1]; \
+            vera_obj *obj1 = vera_get_obj(ctx, i), *obj2 = vera_get_obj(ctx, i + 1); \
             if(obj1->type == VERA_LHS && obj2->type == VERA_RHS) \
                 SKIP_RULE(); \
             else \
@@ -405,142 +765,1963 @@ void vera_intern_strings(vera_ctx *ctx) {
         } \
     } while(0)
 
-static void vera_riscv32_fill_registers(vera_ctx* ctx, uint32_t *registers) {
+/* Adds the facts of the rules with an empty lhs to `registers` */
+void vera_fill_registers(vera_ctx *ctx, uint32_t *registers) {
     size_t i = 0;
     SKIP_PORTS();
     while(i < ctx->obj_count) {
-        assert(ctx->pool[i].type == VERA_LHS);
+        assert(vera_get_obj(ctx, i)->type == VERA_LHS);
         i++; /* we skip the lhs delimiter */
-        if(i < ctx->obj_count && ctx->pool[i].type == VERA_RHS) {
+        if(i < ctx->obj_count && vera_get_obj(ctx, i)->type == VERA_RHS) {
             /* we have an empty lhs*/
             i++; /* we skip the rhs delimiter */
-            while(i < ctx->obj_count && ctx->pool[i].type == VERA_FACT) {
-                vera_obj *obj = &ctx->pool[i];
-                registers[obj->as.fact.intern] += obj->as.fact.attr.count;
+            while(i < ctx->obj_count && vera_get_obj(ctx, i)->type == VERA_FACT) {
+                vera_obj *obj = vera_get_obj(ctx, i);
+                registers[obj->intern] += obj->count;
                 i++;
             }
         } else {
-            while(i < ctx->obj_count && ctx->pool[i].type != VERA_LHS)
+            while(i < ctx->obj_count && vera_get_obj(ctx, i)->type != VERA_LHS)
                 i++;
         }
     }
 }
 
-#define LABELS_LIST_SIZE 256
-#define DECLARE_LABELS_LIST(x) \
-    static uint32_t x##_labels[LABELS_LIST_SIZE]; \
-    unsigned int x##_labels_counter = 0;
+static void *vera_alloc(size_t size) {
+    void *ptr = malloc(size ? size : 1);
+    if(!ptr)
+        ERROR("out of memory");
+    return ptr;
+}
 
-#define MAKE_LABEL(x) \
-    do { \
-        x##_labels[x##_labels_counter++] = pc; \
-    } while(0)
+/* The rules before the one that fired didn't apply, and only the registers it increases can make
+   them apply : the next scan can start at the first reader of these registers, or at the rule
+   itself. When every lhs register of the rule is consumed, the smallest one becomes zero so the
+   rule can't apply again. A chain of producers and consumers then goes from one rule to the next
+   without a full scan, and the firings are the same */
+static void vera_program_resume(vera_program *prog) {
+    prog->resume = (uint32_t*)vera_alloc((prog->rule_count ? prog->rule_count : 1) * sizeof(uint32_t));
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++) {
+        uint32_t consumed = 0, resume = rule;
+        for(uint32_t k = prog->effect_start[rule]; k < prog->effect_start[rule + 1]; k++) {
+            const uint32_t reg = prog->effect_reg[k];
+            if(prog->effect_diff[k] == -1)
+                consumed++;
+            else if(prog->effect_diff[k] > 0 && prog->readers_start[reg] < prog->readers_start[reg + 1])
+                resume = prog->readers[prog->readers_start[reg]] < resume ? prog->readers[prog->readers_start[reg]] : resume;
+        }
+        if(resume == rule && consumed == prog->lhs_start[rule + 1] - prog->lhs_start[rule])
+            resume = rule + 1;
+        prog->resume[rule] = resume;
+    }
+}
 
-/* Assembler inspired by https://zserge.com/posts/post-apocalyptic-programming/ */
+/* Marks the rules that can fire at some point from `registers`, if the registers in `inputs`
+   (may be NULL) can also be set by the host. A rule can fire once all its lhs registers can be
+   non zero, and then its increments can make other rules fire. The other rules never apply,
+   so they can be left out of the generated code without changing the firings */
+void vera_program_live(const vera_program *prog, const uint32_t *registers, const uint8_t *inputs, uint8_t *live) {
+    uint32_t *missing = (uint32_t*)vera_alloc((prog->rule_count ? prog->rule_count : 1) * sizeof(uint32_t));
+    uint32_t *stack = (uint32_t*)vera_alloc((prog->register_count ? prog->register_count : 1) * sizeof(uint32_t));
+    uint8_t *reached = (uint8_t*)vera_alloc(prog->register_count ? prog->register_count : 1);
+    uint32_t top = 0;
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++) {
+        missing[rule] = prog->lhs_start[rule + 1] - prog->lhs_start[rule];
+        live[rule] = 0;
+    }
+    for(unsigned int j = 0; j < prog->register_count; j++) {
+        reached[j] = registers[j] != 0 || (inputs && inputs[j]);
+        if(reached[j])
+            stack[top++] = j;
+    }
+    while(top > 0) {
+        const uint32_t reg = stack[--top];
+        for(uint32_t r = prog->readers_start[reg]; r < prog->readers_start[reg + 1]; r++) {
+            const uint32_t rule = prog->readers[r];
+            if(--missing[rule] > 0)
+                continue;
+            live[rule] = 1;
+            for(uint32_t k = prog->effect_start[rule]; k < prog->effect_start[rule + 1]; k++) {
+                const uint32_t effect = prog->effect_reg[k];
+                if(prog->effect_diff[k] > 0 && !reached[effect]) {
+                    reached[effect] = 1;
+                    stack[top++] = effect;
+                }
+            }
+        }
+    }
+    free(missing);
+    free(stack);
+    free(reached);
+}
 
-static size_t vera_riscv32_assemble(vera_ctx *ctx, uint8_t *output, size_t max_size) {
-    uint32_t pc = 0;
-    static uint32_t start_label = 0, end_label = 0;
-    DECLARE_LABELS_LIST(registers);
-    DECLARE_LABELS_LIST(rules);
-    static uint32_t skip_labels[256];
-    unsigned int skip_labels_counter = 0;
-    /* flags used to check removed duplicates in lhs */
-    int register_processed[ctx->register_count]; /* boolean */
-    /* used to memorize the lhs (then we add the lhs values, and we generate the code if diff != 0) */
-    int32_t register_diff[ctx->register_count];
-    /* risc-v registers */
-    const uint8_t zero = 0, ra = 1, t0 = 5, t1 = 6, t2 = 7, a0 = 10;
-    /* **************** */
-    rv_b(start_label);
-    for(int i = 0; i < ctx->register_count; i++) {
-        MAKE_LABEL(registers);
-        emit(0);
+/* Reverse index, built with a counting sort so the readers of a register stay in rule order.
+   The readers are then grouped by block of 64 rules, in increasing register order */
+static void vera_program_index(vera_program *prog) {
+    const uint32_t lhs_count = prog->lhs_start[prog->rule_count];
+    uint32_t *next = (uint32_t*)vera_alloc(prog->register_count * sizeof(uint32_t));
+    prog->readers_start = (uint32_t*)vera_alloc((prog->register_count + 1) * sizeof(uint32_t));
+    prog->readers = (uint32_t*)vera_alloc(lhs_count * sizeof(uint32_t));
+    for(unsigned int j = 0; j <= prog->register_count; j++)
+        prog->readers_start[j] = 0;
+    for(uint32_t k = 0; k < lhs_count; k++)
+        prog->readers_start[prog->lhs[k] + 1]++;
+    for(unsigned int j = 0; j < prog->register_count; j++)
+        prog->readers_start[j + 1] += prog->readers_start[j];
+    for(unsigned int j = 0; j < prog->register_count; j++)
+        next[j] = prog->readers_start[j];
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++) {
+        for(uint32_t k = prog->lhs_start[rule]; k < prog->lhs_start[rule + 1]; k++)
+            prog->readers[next[prog->lhs[k]]++] = rule;
     }
-    /* the registers start at output + 4, because the first word is a jump instruction */
-    vera_riscv32_fill_registers(ctx, (uint32_t*)(output + 4));
+    free(next);
 
-    start_label = pc;
-    rv_li(a0, 0);
-    int i = 0;
+    const unsigned int block_count = (prog->rule_count + 63) / 64;
+    prog->block_start = (uint32_t*)vera_alloc((block_count + 1) * sizeof(uint32_t));
+    for(unsigned int b = 0; b <= block_count; b++)
+        prog->block_start[b] = 0;
+    /* the readers of a register are sorted, so its entries in the blocks are made in order */
+    for(unsigned int j = 0; j < prog->register_count; j++) {
+        for(uint32_t r = prog->readers_start[j]; r < prog->readers_start[j + 1]; r++) {
+            if(r == prog->readers_start[j] || prog->readers[r] >> 6 != prog->readers[r - 1] >> 6)
+                prog->block_start[(prog->readers[r] >> 6) + 1]++;
+        }
+    }
+    for(unsigned int b = 0; b < block_count; b++)
+        prog->block_start[b + 1] += prog->block_start[b];
+    const uint32_t entry_count = prog->block_start[block_count];
+    prog->block_reg = (uint32_t*)vera_alloc((entry_count ? entry_count : 1) * sizeof(uint32_t));
+    prog->block_rules = (uint64_t*)vera_alloc((entry_count ? entry_count : 1) * sizeof(uint64_t));
+    next = (uint32_t*)vera_alloc((block_count ? block_count : 1) * sizeof(uint32_t));
+    for(unsigned int b = 0; b < block_count; b++)
+        next[b] = prog->block_start[b];
+    for(unsigned int j = 0; j < prog->register_count; j++) {
+        uint32_t entry = 0;
+        for(uint32_t r = prog->readers_start[j]; r < prog->readers_start[j + 1]; r++) {
+            const uint32_t rule = prog->readers[r];
+            if(r == prog->readers_start[j] || rule >> 6 != prog->readers[r - 1] >> 6) {
+                entry = next[rule >> 6]++;
+                prog->block_reg[entry] = j;
+                prog->block_rules[entry] = 0;
+            }
+            prog->block_rules[entry] |= (uint64_t)1 << (rule & 63);
+        }
+    }
+    free(next);
+    vera_program_resume(prog);
+}
+
+void vera_program_init(vera_program *prog, vera_ctx *ctx) {
+    size_t fact_count = 0, rule_count = 0;
+    for(size_t i = 0; i < ctx->obj_count; i++) {
+        vera_obj *obj = vera_get_obj(ctx, i);
+        if(obj->type == VERA_FACT)
+            fact_count++;
+        else if(obj->type == VERA_LHS)
+            rule_count++;
+    }
+    prog->register_count = ctx->register_count;
+    prog->rule_count = 0;
+    prog->lhs_start = (uint32_t*)vera_alloc((rule_count + 1) * sizeof(uint32_t));
+    prog->lhs = (uint32_t*)vera_alloc(fact_count * sizeof(uint32_t));
+    prog->effect_start = (uint32_t*)vera_alloc((rule_count + 1) * sizeof(uint32_t));
+    prog->effect_reg = (uint32_t*)vera_alloc(fact_count * sizeof(uint32_t));
+    prog->effect_diff = (int32_t*)vera_alloc(fact_count * sizeof(int32_t));
+    /* registers used by the current rule, in order of appearance */
+    uint32_t *touched = (uint32_t*)vera_alloc((fact_count > ctx->register_count ? fact_count : ctx->register_count) * sizeof(uint32_t));
+    int32_t *diff = (int32_t*)vera_alloc(ctx->register_count * sizeof(int32_t));
+    char *read = (char*)vera_alloc(ctx->register_count);
+    char *written = (char*)vera_alloc(ctx->register_count);
+    for(unsigned int j = 0; j < ctx->register_count; j++) {
+        diff[j] = 0;
+        read[j] = 0;
+        written[j] = 0;
+    }
+    uint32_t lhs_count = 0, effect_count = 0;
+    size_t i = 0;
     SKIP_PORTS();
     while(i < ctx->obj_count) {
-        for(unsigned int i = 0; i < ctx->register_count; i++) {
-            register_diff[i] = 0;
-            register_processed[i] = 0;
-        }
         SKIP_RULES_WITH_EMPTY_LHS();
         if(i >= ctx->obj_count) break;
-        assert(ctx->pool[i].type == VERA_LHS);
+        assert(vera_get_obj(ctx, i)->type == VERA_LHS);
         i++; /* skip lhs delimiter */
-        MAKE_LABEL(rules);
-        printf("new rule\n");
-        /* we will use t1 to compute the min of the lhs */
-        rv_li(t1, 0xffffffff);
-        while(ctx->pool[i].type == VERA_FACT) {
-            vera_obj *obj = &ctx->pool[i];
-            if(register_processed[obj->as.fact.intern]) {
-                i++; 
-                continue;
+        unsigned int touched_count = 0;
+        prog->lhs_start[prog->rule_count] = lhs_count;
+        prog->effect_start[prog->rule_count] = effect_count;
+        while(vera_get_obj(ctx, i)->type == VERA_FACT) {
+            vera_obj *obj = vera_get_obj(ctx, i);
+            if(!read[obj->intern]) {
+                read[obj->intern] = 1;
+                prog->lhs[lhs_count++] = obj->intern;
             }
-            if(obj->as.fact.attr.keep)
-                register_diff[obj->as.fact.intern] = 0;
-            else
-                register_diff[obj->as.fact.intern] = -1;
-            rv_load(t0, registers_labels[obj->as.fact.intern]);
-            rv_li(t2, 0);
-            rv_beq(t0, t2, rules_labels[rules_labels_counter] - pc); /* we skip to next rule if one of the registers is zero */
-            rv_bgeu(t0, t1, skip_labels[skip_labels_counter] - pc);
-            rv_add(t1, zero, t0);
-            MAKE_LABEL(skip);
+            if(!written[obj->intern]) {
+                written[obj->intern] = 1;
+                touched[touched_count++] = obj->intern;
+            }
+            /* like in the generated code, the last occurrence of a fact in the lhs decides if it is kept */
+            diff[obj->intern] = obj->keep ? 0 : -1;
             i++;
         }
-        assert(ctx->pool[i].type == VERA_RHS);
+        assert(vera_get_obj(ctx, i)->type == VERA_RHS);
         i++; /* skip rhs delimiter */
-        while(i < ctx->obj_count && ctx->pool[i].type == VERA_FACT) {
-            const vera_obj *obj = &ctx->pool[i];
-            const int interned = obj->as.fact.intern;
-            register_diff[interned] += obj->as.fact.attr.count;
-            i++; 
-        }
-        for(unsigned int j = 0; j < ctx->register_count; j++) {
-            int32_t diff = register_diff[j];
-            if(diff != 0) {
-                rv_load(t0, registers_labels[j]);
-                rv_load_i32_imm(t2, diff);
-                rv_mul(t2, t2, t1);
-                rv_add(t0, t0, t2);
-                rv_store(t0, t2, registers_labels[j]);
+        while(i < ctx->obj_count && vera_get_obj(ctx, i)->type == VERA_FACT) {
+            vera_obj *obj = vera_get_obj(ctx, i);
+            if(!written[obj->intern]) {
+                written[obj->intern] = 1;
+                touched[touched_count++] = obj->intern;
             }
+            diff[obj->intern] += obj->count;
+            i++;
         }
-        rv_addi(a0, a0, 1);
-        rv_b(end_label);
+        for(unsigned int j = 0; j < touched_count; j++) {
+            const uint32_t reg = touched[j];
+            if(diff[reg] != 0) {
+                prog->effect_reg[effect_count] = reg;
+                prog->effect_diff[effect_count] = diff[reg];
+                effect_count++;
+            }
+            diff[reg] = 0;
+            read[reg] = 0;
+            written[reg] = 0;
+        }
+        prog->rule_count++;
+    }
+    prog->lhs_start[prog->rule_count] = lhs_count;
+    prog->effect_start[prog->rule_count] = effect_count;
+    vera_program_index(prog);
+    free(touched);
+    free(diff);
+    free(read);
+    free(written);
+}
+
+void vera_program_free(vera_program *prog) {
+    free(prog->lhs_start);
+    free(prog->lhs);
+    free(prog->effect_start);
+    free(prog->effect_reg);
+    free(prog->effect_diff);
+    free(prog->readers_start);
+    free(prog->readers);
+    free(prog->block_start);
+    free(prog->block_reg);
+    free(prog->block_rules);
+    free(prog->resume);
+}
+
+/* The line of a rule is the one of its first lhs fact */
+void vera_profile_init(vera_profile *profile, vera_ctx *ctx) {
+    size_t rule_count = 0, offset = 0;
+    uint32_t line = 1;
+    for(size_t i = 0; i + 1 < ctx->obj_count; i++) {
+        if(vera_get_obj(ctx, i)->type == VERA_LHS && vera_get_obj(ctx, i + 1)->type == VERA_FACT)
+            rule_count++;
     }
-    MAKE_LABEL(rules); /* make a new (empty) rule label so that the last rule can make a jump here */
-    for(unsigned int i = 0; i < rules_labels_counter; i++) {
-        printf("rules_labels[%u] = %d\n", i, rules_labels[i]);
+    profile->rule_count = 0;
+    profile->rules = (vera_rule_profile*)vera_alloc((rule_count ? rule_count : 1) * sizeof(vera_rule_profile));
+    for(size_t i = 0; i + 1 < ctx->obj_count; i++) {
+        vera_obj *fact = vera_get_obj(ctx, i + 1);
+        if(vera_get_obj(ctx, i)->type != VERA_LHS || fact->type != VERA_FACT)
+            continue;
+        for(; offset < fact->offset; offset++)
+            line += ctx->src[offset] == '\n';
+        vera_rule_profile *rule = &profile->rules[profile->rule_count++];
+        rule->line = line;
+        rule->fired = 0;
+        rule->rejected = 0;
     }
-    end_label = pc;
-    rv_break();
-    rv_ret();
-    return pc;
 }
 
-#undef SKIP_PORTS
+/* Adds the counters of a run, 2 * profile->rule_count words */
+void vera_profile_add(vera_profile *profile, const uint32_t *counters) {
+    for(unsigned int r = 0; r < profile->rule_count; r++) {
+        profile->rules[r].fired += counters[2 * r];
+        profile->rules[r].rejected += counters[2 * r + 1];
+    }
+}
 
-size_t vera_riscv32_codegen(vera_ctx *ctx, uint8_t *output, size_t max_size) {
-    printf("pass 1\n");
-    vera_riscv32_assemble(ctx, output, max_size); /* first pass to calculate the labels */
-    printf("pass 2\n");
-    return vera_riscv32_assemble(ctx, output, max_size);
+void vera_profile_free(vera_profile *profile) {
+    free(profile->rules);
+    profile->rules = NULL;
+    profile->rule_count = 0;
 }
 
+/* Fires the first applicable rule as many times as the smallest of its lhs facts allows,
+   until no rule applies or `max_firings` rules have been fired (0 means no limit).
+   Returns the number of firings */
+uint32_t vera_run(const vera_program *prog, uint32_t *registers, uint32_t max_firings) {
+    uint32_t firings = 0;
+    unsigned int start = 0;
+    while(max_firings == 0 || firings < max_firings) {
+        unsigned int rule;
+        uint32_t min = 0;
+        for(rule = start; rule < prog->rule_count; rule++) {
+            const uint32_t end = prog->lhs_start[rule + 1];
+            uint32_t k;
+            min = 0xffffffff;
+            for(k = prog->lhs_start[rule]; k < end; k++) {
+                const uint32_t value = registers[prog->lhs[k]];
+                if(value == 0)
+                    break;
+                if(value < min)
+                    min = value;
+            }
+            if(k == end)
+                break;
+        }
+        if(rule == prog->rule_count)
+            break;
+        for(uint32_t k = prog->effect_start[rule]; k < prog->effect_start[rule + 1]; k++)
+            registers[prog->effect_reg[k]] += (uint32_t)prog->effect_diff[k] * min;
+        start = prog->resume[rule];
+        firings++;
+    }
+    return firings;
+}
+
+#if defined(__GNUC__)
+#define vera_ctz64(x) __builtin_ctzll(x)
+#else
+static int vera_ctz64(uint64_t x) {
+    int n = 0;
+    while(!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+}
 #endif
 
-void vera_compile(vera_ctx *ctx) {
+/* bitset of the applicable rules, with a summary word for every 64 words so that
+   the first applicable rule is found in a few ctz */
+typedef struct {
+    uint64_t *words;
+    uint64_t *summary;
+    unsigned int summary_count;
+} vera_rule_set;
+
+static void vera_rule_set_add(vera_rule_set *set, unsigned int rule) {
+    set->words[rule >> 6] |= (uint64_t)1 << (rule & 63);
+    set->summary[rule >> 12] |= (uint64_t)1 << ((rule >> 6) & 63);
+}
+
+static void vera_rule_set_remove(vera_rule_set *set, unsigned int rule) {
+    set->words[rule >> 6] &= ~((uint64_t)1 << (rule & 63));
+    if(set->words[rule >> 6] == 0)
+        set->summary[rule >> 12] &= ~((uint64_t)1 << ((rule >> 6) & 63));
+}
+
+/* returns -1 if the set is empty */
+static long vera_rule_set_first(const vera_rule_set *set) {
+    for(unsigned int s = 0; s < set->summary_count; s++) {
+        if(set->summary[s]) {
+            const unsigned int word = s * 64 + vera_ctz64(set->summary[s]);
+            return word * 64 + vera_ctz64(set->words[word]);
+        }
+    }
+    return -1;
+}
+
+/* Same semantics as vera_run, but instead of checking every rule after each firing,
+   it keeps for every rule the number of its lhs registers that are zero, and only updates
+   the readers of the registers that became zero or non zero. The cost of a firing depends
+   on its fan-out (plus one summary word per 4096 rules), not on the size of the program */
+uint32_t vera_run_incremental(const vera_program *prog, uint32_t *registers, uint32_t max_firings) {
+    const unsigned int word_count = (prog->rule_count + 63) / 64;
+    vera_rule_set ready;
+    ready.summary_count = (word_count + 63) / 64;
+    ready.words = (uint64_t*)vera_alloc(word_count * sizeof(uint64_t));
+    ready.summary = (uint64_t*)vera_alloc(ready.summary_count * sizeof(uint64_t));
+    uint32_t *zero_count = (uint32_t*)vera_alloc(prog->rule_count * sizeof(uint32_t));
+    for(unsigned int i = 0; i < word_count; i++)
+        ready.words[i] = 0;
+    for(unsigned int i = 0; i < ready.summary_count; i++)
+        ready.summary[i] = 0;
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++) {
+        zero_count[rule] = 0;
+        for(uint32_t k = prog->lhs_start[rule]; k < prog->lhs_start[rule + 1]; k++)
+            zero_count[rule] += registers[prog->lhs[k]] == 0;
+        if(zero_count[rule] == 0)
+            vera_rule_set_add(&ready, rule);
+    }
+    uint32_t firings = 0;
+    while(max_firings == 0 || firings < max_firings) {
+        const long rule = vera_rule_set_first(&ready);
+        if(rule < 0)
+            break;
+        uint32_t min = 0xffffffff;
+        for(uint32_t k = prog->lhs_start[rule]; k < prog->lhs_start[rule + 1]; k++) {
+            if(registers[prog->lhs[k]] < min)
+                min = registers[prog->lhs[k]];
+        }
+        for(uint32_t k = prog->effect_start[rule]; k < prog->effect_start[rule + 1]; k++) {
+            const uint32_t reg = prog->effect_reg[k];
+            const uint32_t old = registers[reg];
+            registers[reg] += (uint32_t)prog->effect_diff[k] * min;
+            if((old == 0) == (registers[reg] == 0))
+                continue;
+            for(uint32_t r = prog->readers_start[reg]; r < prog->readers_start[reg + 1]; r++) {
+                const uint32_t reader = prog->readers[r];
+                if(registers[reg] == 0) {
+                    if(zero_count[reader]++ == 0)
+                        vera_rule_set_remove(&ready, reader);
+                } else {
+                    if(--zero_count[reader] == 0)
+                        vera_rule_set_add(&ready, reader);
+                }
+            }
+        }
+        firings++;
+    }
+    free(ready.words);
+    free(ready.summary);
+    free(zero_count);
+    return firings;
+}
+
+/* Same semantics as vera_run, but the rules are checked against a bitset of the non zero
+   registers instead of the registers themselves. In a block of 64 rules, the rules reading a
+   zero register are cleared with one AND per register read in the block, and the first rule
+   left is found with a ctz. The registers are only loaded for the rule that fires */
+uint32_t vera_run_bitset(const vera_program *prog, uint32_t *registers, uint32_t max_firings) {
+    const unsigned int block_count = (prog->rule_count + 63) / 64;
+    const unsigned int word_count = (prog->register_count + 63) / 64;
+    uint64_t *nonzero = (uint64_t*)vera_alloc((word_count ? word_count : 1) * sizeof(uint64_t));
+    for(unsigned int w = 0; w < word_count; w++)
+        nonzero[w] = 0;
+    for(unsigned int j = 0; j < prog->register_count; j++)
+        nonzero[j >> 6] |= (uint64_t)(registers[j] != 0) << (j & 63);
+    uint32_t firings = 0;
+    while(max_firings == 0 || firings < max_firings) {
+        long rule = -1;
+        for(unsigned int b = 0; b < block_count; b++) {
+            const unsigned int rest = prog->rule_count - 64 * b;
+            uint64_t candidates = rest >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << rest) - 1;
+            /* branchless, the mask is all ones if the register is zero */
+            for(uint32_t k = prog->block_start[b]; k < prog->block_start[b + 1]; k++) {
+                const uint32_t reg = prog->block_reg[k];
+                candidates &= ~(prog->block_rules[k] & (((nonzero[reg >> 6] >> (reg & 63)) & 1) - 1));
+            }
+            if(candidates) {
+                rule = 64 * b + vera_ctz64(candidates);
+                break;
+            }
+        }
+        if(rule < 0)
+            break;
+        uint32_t min = 0xffffffff;
+        for(uint32_t k = prog->lhs_start[rule]; k < prog->lhs_start[rule + 1]; k++) {
+            if(registers[prog->lhs[k]] < min)
+                min = registers[prog->lhs[k]];
+        }
+        for(uint32_t k = prog->effect_start[rule]; k < prog->effect_start[rule + 1]; k++) {
+            const uint32_t reg = prog->effect_reg[k];
+            registers[reg] += (uint32_t)prog->effect_diff[k] * min;
+            if(registers[reg])
+                nonzero[reg >> 6] |= (uint64_t)1 << (reg & 63);
+            else
+                nonzero[reg >> 6] &= ~((uint64_t)1 << (reg & 63));
+        }
+        firings++;
+    }
+    free(nonzero);
+    return firings;
+}
+
+/* Batch engine : the instances are run VERA_BATCH_LANES at a time, in lockstep. At every step,
+   each lane scans the rules from the first one and fires the first rule that applies to it,
+   the lanes that pick different rules are masked out of each other's updates */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VERA_BATCH_LANES 8
+#define VERA_BATCH_ISA "avx2"
+typedef __m256i vera_vec;
+#define vera_vec_load(p) _mm256_loadu_si256((const __m256i*)(p))
+#define vera_vec_store(p, v) _mm256_storeu_si256((__m256i*)(p), v)
+#define vera_vec_set1(x) _mm256_set1_epi32((int)(x))
+#define vera_vec_min(a, b) _mm256_min_epu32(a, b)
+#define vera_vec_add(a, b) _mm256_add_epi32(a, b)
+#define vera_vec_mul(a, b) _mm256_mullo_epi32(a, b)
+#define vera_vec_and(a, b) _mm256_and_si256(a, b)
+#define vera_vec_andnot(a, b) _mm256_andnot_si256(a, b) /* ~a & b */
+#define vera_vec_eq(a, b) _mm256_cmpeq_epi32(a, b)
+#define vera_vec_any(v) (!_mm256_testz_si256(v, v))
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define VERA_BATCH_LANES 4
+#define VERA_BATCH_ISA "sse4.1"
+typedef __m128i vera_vec;
+#define vera_vec_load(p) _mm_loadu_si128((const __m128i*)(p))
+#define vera_vec_store(p, v) _mm_storeu_si128((__m128i*)(p), v)
+#define vera_vec_set1(x) _mm_set1_epi32((int)(x))
+#define vera_vec_min(a, b) _mm_min_epu32(a, b)
+#define vera_vec_add(a, b) _mm_add_epi32(a, b)
+#define vera_vec_mul(a, b) _mm_mullo_epi32(a, b)
+#define vera_vec_and(a, b) _mm_and_si128(a, b)
+#define vera_vec_andnot(a, b) _mm_andnot_si128(a, b) /* ~a & b */
+#define vera_vec_eq(a, b) _mm_cmpeq_epi32(a, b)
+#define vera_vec_any(v) (!_mm_testz_si128(v, v))
+#else
+/* portable fallback, the compiler may still vectorize it */
+#define VERA_BATCH_LANES 4
+#define VERA_BATCH_ISA "portable"
+typedef struct { uint32_t lane[VERA_BATCH_LANES]; } vera_vec;
+#define VERA_VEC_MAP(expr) \
+    vera_vec r; \
+    for(int i = 0; i < VERA_BATCH_LANES; i++) \
+        r.lane[i] = (expr); \
+    return r;
+static vera_vec vera_vec_load(const uint32_t *p) { VERA_VEC_MAP(p[i]) }
+static void vera_vec_store(uint32_t *p, vera_vec v) { memcpy(p, v.lane, sizeof(v.lane)); }
+static vera_vec vera_vec_set1(uint32_t x) { VERA_VEC_MAP(x) }
+static vera_vec vera_vec_min(vera_vec a, vera_vec b) { VERA_VEC_MAP(a.lane[i] < b.lane[i] ? a.lane[i] : b.lane[i]) }
+static vera_vec vera_vec_add(vera_vec a, vera_vec b) { VERA_VEC_MAP(a.lane[i] + b.lane[i]) }
+static vera_vec vera_vec_mul(vera_vec a, vera_vec b) { VERA_VEC_MAP(a.lane[i] * b.lane[i]) }
+static vera_vec vera_vec_and(vera_vec a, vera_vec b) { VERA_VEC_MAP(a.lane[i] & b.lane[i]) }
+static vera_vec vera_vec_andnot(vera_vec a, vera_vec b) { VERA_VEC_MAP(~a.lane[i] & b.lane[i]) }
+static vera_vec vera_vec_eq(vera_vec a, vera_vec b) { VERA_VEC_MAP(a.lane[i] == b.lane[i] ? 0xffffffff : 0) }
+static int vera_vec_any(vera_vec v) {
+    uint32_t any = 0;
+    for(int i = 0; i < VERA_BATCH_LANES; i++)
+        any |= v.lane[i];
+    return any != 0;
+}
+#undef VERA_VEC_MAP
+#endif
+
+/* The counters are zero */
+void vera_batch_init(vera_batch *batch, const vera_program *prog, unsigned int instance_count) {
+    batch->prog = prog;
+    batch->instance_count = instance_count;
+    batch->stride = (instance_count + VERA_BATCH_LANES - 1) / VERA_BATCH_LANES * VERA_BATCH_LANES;
+    batch->counters = (uint32_t*)vera_alloc((size_t)prog->register_count * batch->stride * sizeof(uint32_t));
+    batch->firings = (uint32_t*)vera_alloc(batch->stride * sizeof(uint32_t));
+    memset(batch->counters, 0, (size_t)prog->register_count * batch->stride * sizeof(uint32_t));
+    memset(batch->firings, 0, batch->stride * sizeof(uint32_t));
+}
+
+void vera_batch_free(vera_batch *batch) {
+    free(batch->counters);
+    free(batch->firings);
+    batch->counters = NULL;
+    batch->firings = NULL;
+}
+
+/* Copies the registers of one instance in and out of the batch */
+void vera_batch_set(vera_batch *batch, unsigned int instance, const uint32_t *registers) {
+    for(unsigned int r = 0; r < batch->prog->register_count; r++)
+        batch->counters[(size_t)r * batch->stride + instance] = registers[r];
+}
+
+void vera_batch_get(const vera_batch *batch, unsigned int instance, uint32_t *registers) {
+    for(unsigned int r = 0; r < batch->prog->register_count; r++)
+        registers[r] = batch->counters[(size_t)r * batch->stride + instance];
+}
+
+/* Runs every instance like vera_run, with at most `max_firings` firings per instance
+   (no limit if 0) */
+void vera_batch_run(vera_batch *batch, uint32_t max_firings) {
+    const vera_program *prog = batch->prog;
+    const size_t stride = batch->stride;
+    const vera_vec zero = vera_vec_set1(0), one = vera_vec_set1(1), fuel = vera_vec_set1(max_firings);
+    for(unsigned int block = 0; block < batch->stride; block += VERA_BATCH_LANES) {
+        uint32_t *counters = batch->counters + block;
+        uint32_t lanes[VERA_BATCH_LANES];
+        for(unsigned int i = 0; i < VERA_BATCH_LANES; i++)
+            lanes[i] = block + i < batch->instance_count ? 0xffffffff : 0;
+        /* lanes still running, and the firings of every lane */
+        vera_vec active = vera_vec_load(lanes), firings = zero;
+        while(vera_vec_any(active)) {
+            /* lanes that haven't found a rule to fire during this step */
+            vera_vec pending = active;
+            for(unsigned int rule = 0; rule < prog->rule_count && vera_vec_any(pending); rule++) {
+                const uint32_t end = prog->lhs_start[rule + 1];
+                vera_vec min = vera_vec_load(counters + prog->lhs[prog->lhs_start[rule]] * stride);
+                for(uint32_t k = prog->lhs_start[rule] + 1; k < end && vera_vec_any(vera_vec_and(min, pending)); k++)
+                    min = vera_vec_min(min, vera_vec_load(counters + prog->lhs[k] * stride));
+                /* the pending lanes where every counter of the lhs is non zero fire the rule */
+                const vera_vec fire = vera_vec_andnot(vera_vec_eq(min, zero), pending);
+                if(!vera_vec_any(fire))
+                    continue;
+                min = vera_vec_and(min, fire);
+                for(uint32_t k = prog->effect_start[rule]; k < prog->effect_start[rule + 1]; k++) {
+                    uint32_t *counter = counters + prog->effect_reg[k] * stride;
+                    const vera_vec diff = vera_vec_mul(vera_vec_set1((uint32_t)prog->effect_diff[k]), min);
+                    vera_vec_store(counter, vera_vec_add(vera_vec_load(counter), diff));
+                }
+                pending = vera_vec_andnot(fire, pending);
+            }
+            /* the lanes left pending have no applicable rule */
+            active = vera_vec_andnot(pending, active);
+            firings = vera_vec_add(firings, vera_vec_and(active, one));
+            if(max_firings)
+                active = vera_vec_andnot(vera_vec_eq(firings, fuel), active);
+        }
+        vera_vec_store(batch->firings + block, firings);
+    }
+}
+
+/* Partition of the rules. Whatever rule the sequential run picks, it is also the first applicable
+   rule of its own component, and it doesn't change the registers of the other components.
+   So the firings of a component in the sequential run are the run of the component alone, and
+   once every component is stuck the final state is the same */
+
+static uint32_t vera_find(uint32_t *parent, uint32_t x) {
+    while(parent[x] != x) {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+    return x;
+}
 
+/* the first rule of a component is its root, so that the components are numbered in program order */
+static void vera_union(uint32_t *parent, uint32_t a, uint32_t b) {
+    a = vera_find(parent, a);
+    b = vera_find(parent, b);
+    if(a < b)
+        parent[b] = a;
+    else if(b < a)
+        parent[a] = b;
 }
 
+void vera_partition_init(vera_partition *part, const vera_program *prog) {
+    const uint32_t none = 0xffffffff;
+    uint32_t *parent = (uint32_t*)vera_alloc(prog->rule_count * sizeof(uint32_t));
+    /* the first rule using each register */
+    uint32_t *owner = (uint32_t*)vera_alloc(prog->register_count * sizeof(uint32_t));
+    char *written = (char*)vera_alloc(prog->register_count);
+    for(unsigned int j = 0; j < prog->register_count; j++) {
+        owner[j] = none;
+        written[j] = 0;
+    }
+    for(uint32_t k = 0; k < prog->effect_start[prog->rule_count]; k++)
+        written[prog->effect_reg[k]] = 1;
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++)
+        parent[rule] = rule;
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++) {
+        /* registers that are only read are constants, they don't make rules interact */
+        for(uint32_t k = prog->lhs_start[rule]; k < prog->lhs_start[rule + 1]; k++) {
+            const uint32_t reg = prog->lhs[k];
+            if(!written[reg])
+                continue;
+            if(owner[reg] == none)
+                owner[reg] = rule;
+            else
+                vera_union(parent, owner[reg], rule);
+        }
+        for(uint32_t k = prog->effect_start[rule]; k < prog->effect_start[rule + 1]; k++) {
+            const uint32_t reg = prog->effect_reg[k];
+            if(owner[reg] == none)
+                owner[reg] = rule;
+            else
+                vera_union(parent, owner[reg], rule);
+        }
+    }
+    part->rule_component = (uint32_t*)vera_alloc(prog->rule_count * sizeof(uint32_t));
+    part->component_count = 0;
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++) {
+        const uint32_t root = vera_find(parent, rule);
+        if(root == rule)
+            part->rule_component[rule] = part->component_count++;
+        else
+            part->rule_component[rule] = part->rule_component[root];
+    }
+    /* sizes of the components, then their rules */
+    part->components = (vera_program*)vera_alloc(part->component_count * sizeof(vera_program));
+    /* there can be more components than registers, so they get their own counts */
+    uint32_t *lhs_total = (uint32_t*)vera_alloc(part->component_count * sizeof(uint32_t));
+    uint32_t *effect_total = (uint32_t*)vera_alloc(part->component_count * sizeof(uint32_t));
+    for(unsigned int c = 0; c < part->component_count; c++) {
+        part->components[c].rule_count = 0;
+        part->components[c].register_count = prog->register_count;
+        lhs_total[c] = 0;
+        effect_total[c] = 0;
+    }
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++) {
+        const uint32_t c = part->rule_component[rule];
+        part->components[c].rule_count++;
+        lhs_total[c] += prog->lhs_start[rule + 1] - prog->lhs_start[rule];
+        effect_total[c] += prog->effect_start[rule + 1] - prog->effect_start[rule];
+    }
+    for(unsigned int c = 0; c < part->component_count; c++) {
+        vera_program *comp = &part->components[c];
+        comp->lhs_start = (uint32_t*)vera_alloc((comp->rule_count + 1) * sizeof(uint32_t));
+        comp->lhs = (uint32_t*)vera_alloc(lhs_total[c] * sizeof(uint32_t));
+        comp->effect_start = (uint32_t*)vera_alloc((comp->rule_count + 1) * sizeof(uint32_t));
+        comp->effect_reg = (uint32_t*)vera_alloc(effect_total[c] * sizeof(uint32_t));
+        comp->effect_diff = (int32_t*)vera_alloc(effect_total[c] * sizeof(int32_t));
+        comp->lhs_start[0] = 0;
+        comp->effect_start[0] = 0;
+        comp->rule_count = 0;
+    }
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++) {
+        vera_program *comp = &part->components[part->rule_component[rule]];
+        uint32_t lhs_count = comp->lhs_start[comp->rule_count], effect_count = comp->effect_start[comp->rule_count];
+        for(uint32_t k = prog->lhs_start[rule]; k < prog->lhs_start[rule + 1]; k++)
+            comp->lhs[lhs_count++] = prog->lhs[k];
+        for(uint32_t k = prog->effect_start[rule]; k < prog->effect_start[rule + 1]; k++) {
+            comp->effect_reg[effect_count] = prog->effect_reg[k];
+            comp->effect_diff[effect_count] = prog->effect_diff[k];
+            effect_count++;
+        }
+        comp->rule_count++;
+        comp->lhs_start[comp->rule_count] = lhs_count;
+        comp->effect_start[comp->rule_count] = effect_count;
+    }
+    for(unsigned int c = 0; c < part->component_count; c++)
+        vera_program_index(&part->components[c]);
+    free(parent);
+    free(owner);
+    free(written);
+    free(lhs_total);
+    free(effect_total);
+}
+
+void vera_partition_free(vera_partition *part) {
+    for(unsigned int c = 0; c < part->component_count; c++)
+        vera_program_free(&part->components[c]);
+    free(part->components);
+    free(part->rule_component);
+    part->components = NULL;
+    part->rule_component = NULL;
+    part->component_count = 0;
+}
+
+typedef struct {
+    const vera_partition *part;
+    uint32_t *registers;
+    uint32_t max_firings;
+    unsigned int first, step; /* the components of the worker */
+    uint32_t firings;
+    unsigned int exhausted; /* components stopped by the fuel */
+} vera_worker;
+
+static void *vera_worker_run(void *arg) {
+    vera_worker *worker = (vera_worker*)arg;
+    for(unsigned int c = worker->first; c < worker->part->component_count; c += worker->step) {
+        const uint32_t firings = vera_run(&worker->part->components[c], worker->registers, worker->max_firings);
+        if(worker->max_firings && firings == worker->max_firings)
+            worker->exhausted++;
+        worker->firings += firings;
+    }
+    return NULL;
+}
+
+#ifdef VERA_THREADS
+#include <pthread.h>
+#endif
+
+/* vera_run_parallel, which also counts the components that used up their fuel in `exhausted` */
+static uint32_t vera_run_components(const vera_partition *part, uint32_t *registers, uint32_t max_firings,
+                                    unsigned int thread_count, unsigned int *exhausted) {
+    if(thread_count > part->component_count)
+        thread_count = part->component_count;
+    *exhausted = 0;
+#ifdef VERA_THREADS
+    if(thread_count > 1) {
+        uint32_t firings = 0;
+        vera_worker *workers = (vera_worker*)vera_alloc(thread_count * sizeof(vera_worker));
+        pthread_t *threads = (pthread_t*)vera_alloc(thread_count * sizeof(pthread_t));
+        for(unsigned int t = 0; t < thread_count; t++) {
+            vera_worker worker = { part, registers, max_firings, t, thread_count, 0, 0 };
+            workers[t] = worker;
+            if(pthread_create(&threads[t], NULL, vera_worker_run, &workers[t]))
+                ERROR("can't create thread");
+        }
+        for(unsigned int t = 0; t < thread_count; t++) {
+            pthread_join(threads[t], NULL);
+            firings += workers[t].firings;
+            *exhausted += workers[t].exhausted;
+        }
+        free(workers);
+        free(threads);
+        return firings;
+    }
+#endif
+    vera_worker worker = { part, registers, max_firings, 0, 1, 0, 0 };
+    vera_worker_run(&worker);
+    *exhausted = worker.exhausted;
+    return worker.firings;
+}
+
+/* Runs every component until it is stuck or has fired `max_firings` rules (0 means no limit).
+   The components are shared among `thread_count` threads if VERA_THREADS is defined, and run one
+   after the other otherwise. The final state is the one of vera_run if the program terminates,
+   and the fuel is per component. Returns the total number of firings */
+uint32_t vera_run_parallel(const vera_partition *part, uint32_t *registers, uint32_t max_firings, unsigned int thread_count) {
+    unsigned int exhausted;
+    return vera_run_components(part, registers, max_firings, thread_count, &exhausted);
+}
+
+/* Checks the partition : runs the program sequentially and by components on copies of `registers`,
+   with `max_firings` for the sequential run and for every component (0 means no limit, the program
+   must then terminate). The final states are only compared if every run stopped on its own,
+   otherwise the result is VERA_VERIFY_INCONCLUSIVE */
+int vera_verify_parallel(const vera_program *prog, const vera_partition *part, const uint32_t *registers,
+                         uint32_t max_firings, unsigned int thread_count) {
+    uint32_t *sequential = (uint32_t*)vera_alloc(prog->register_count * sizeof(uint32_t));
+    uint32_t *parallel = (uint32_t*)vera_alloc(prog->register_count * sizeof(uint32_t));
+    unsigned int exhausted;
+    int result = VERA_VERIFY_SAME;
+    memcpy(sequential, registers, prog->register_count * sizeof(uint32_t));
+    memcpy(parallel, registers, prog->register_count * sizeof(uint32_t));
+    const uint32_t firings = vera_run(prog, sequential, max_firings);
+    vera_run_components(part, parallel, max_firings, thread_count, &exhausted);
+    if((max_firings && firings == max_firings) || exhausted) {
+        result = VERA_VERIFY_INCONCLUSIVE;
+    } else {
+        for(unsigned int j = 0; j < prog->register_count; j++) {
+            if(sequential[j] != parallel[j])
+                result = VERA_VERIFY_DIFFERENT;
+        }
+    }
+    free(sequential);
+    free(parallel);
+    return result;
+}
+
+/* Rings and ports. The producer publishes `head` after writing the values, and the consumer
+   publishes `tail` after reading them, so each side only needs acquire loads of the other index */
+
+#if defined(__GNUC__)
+#define VERA_LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define VERA_STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+/* no ordering guarantees : the producer and the consumer must run on the same thread */
+#define VERA_LOAD_ACQUIRE(p) (*(volatile uint32_t*)(p))
+#define VERA_STORE_RELEASE(p, v) (*(volatile uint32_t*)(p) = (v))
+#endif
+
+/* `capacity` is rounded up to a power of two */
+void vera_ring_init(vera_ring *ring, uint32_t capacity) {
+    ring->capacity = 1;
+    while(ring->capacity < capacity)
+        ring->capacity *= 2;
+    ring->data = (uint32_t*)vera_alloc(ring->capacity * sizeof(uint32_t));
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+void vera_ring_free(vera_ring *ring) {
+    free(ring->data);
+    ring->data = NULL;
+}
+
+/* Producer : the free slots that follow each other in memory, to be filled then committed */
+uint32_t vera_ring_writable(vera_ring *ring, uint32_t **values) {
+    const uint32_t head = ring->head, tail = VERA_LOAD_ACQUIRE(&ring->tail);
+    const uint32_t start = head & (ring->capacity - 1), free_count = ring->capacity - (head - tail);
+    *values = ring->data + start;
+    return free_count < ring->capacity - start ? free_count : ring->capacity - start;
+}
+
+void vera_ring_commit(vera_ring *ring, uint32_t count) {
+    VERA_STORE_RELEASE(&ring->head, ring->head + count);
+}
+
+/* Consumer : the values that follow each other in memory, to be read then consumed */
+uint32_t vera_ring_readable(vera_ring *ring, const uint32_t **values) {
+    const uint32_t tail = ring->tail, head = VERA_LOAD_ACQUIRE(&ring->head);
+    const uint32_t start = tail & (ring->capacity - 1), count = head - tail;
+    *values = ring->data + start;
+    return count < ring->capacity - start ? count : ring->capacity - start;
+}
+
+void vera_ring_consume(vera_ring *ring, uint32_t count) {
+    VERA_STORE_RELEASE(&ring->tail, ring->tail + count);
+}
+
+/* Copying versions, they return the number of values written or read */
+uint32_t vera_ring_write(vera_ring *ring, const uint32_t *values, uint32_t count) {
+    uint32_t done = 0;
+    while(done < count) {
+        uint32_t *slots;
+        uint32_t n = vera_ring_writable(ring, &slots);
+        if(n == 0)
+            break;
+        if(n > count - done)
+            n = count - done;
+        memcpy(slots, values + done, n * sizeof(uint32_t));
+        vera_ring_commit(ring, n);
+        done += n;
+    }
+    return done;
+}
+
+uint32_t vera_ring_read(vera_ring *ring, uint32_t *values, uint32_t count) {
+    uint32_t done = 0;
+    while(done < count) {
+        const uint32_t *slots;
+        uint32_t n = vera_ring_readable(ring, &slots);
+        if(n == 0)
+            break;
+        if(n > count - done)
+            n = count - done;
+        memcpy(values + done, slots, n * sizeof(uint32_t));
+        vera_ring_consume(ring, n);
+        done += n;
+    }
+    return done;
+}
+
+void vera_port_io_init(vera_port_io *io, unsigned int port_count, uint32_t capacity) {
+    io->port_count = port_count;
+    io->in = (vera_ring*)vera_alloc(port_count * sizeof(vera_ring));
+    io->out = (vera_ring*)vera_alloc(port_count * sizeof(vera_ring));
+    io->pending = (uint32_t*)vera_alloc(port_count * sizeof(uint32_t));
+    for(unsigned int i = 0; i < port_count; i++) {
+        vera_ring_init(&io->in[i], capacity);
+        vera_ring_init(&io->out[i], capacity);
+        io->pending[i] = 0;
+    }
+}
+
+void vera_port_io_free(vera_port_io *io) {
+    for(unsigned int i = 0; i < io->port_count; i++) {
+        vera_ring_free(&io->in[i]);
+        vera_ring_free(&io->out[i]);
+    }
+    free(io->in);
+    free(io->out);
+    free(io->pending);
+    io->port_count = 0;
+}
+
+/* For the MMIO load hook, `offset` is relative to port_mmio_base. Reading port i takes every
+   increment waiting in in[i] at once, their sum is added to the counter by the program.
+   Returns 0 if the address isn't a port */
+int vera_port_io_load(vera_port_io *io, uint32_t offset, uint32_t *value) {
+    const uint32_t port = offset / 8;
+    if(port >= io->port_count || offset % 8 != 0)
+        return 0;
+    *value = 0;
+    for(;;) {
+        const uint32_t *values;
+        const uint32_t n = vera_ring_readable(&io->in[port], &values);
+        if(n == 0)
+            break;
+        for(uint32_t k = 0; k < n; k++)
+            *value += values[k];
+        vera_ring_consume(&io->in[port], n);
+    }
+    return 1;
+}
+
+/* For the MMIO store hook. An increment is never lost nor blocks the program : if out[i] is full
+   it is added to the increments waiting for the next store or vera_port_io_flush */
+int vera_port_io_store(vera_port_io *io, uint32_t offset, uint32_t value) {
+    const uint32_t port = offset / 8;
+    uint32_t *slot;
+    if(port >= io->port_count || offset % 8 != 4)
+        return 0;
+    io->pending[port] += value;
+    if(vera_ring_writable(&io->out[port], &slot) > 0) {
+        *slot = io->pending[port];
+        vera_ring_commit(&io->out[port], 1);
+        io->pending[port] = 0;
+    }
+    return 1;
+}
+
+/* From the program side, for example after the ebreak. Returns 1 if nothing is left waiting */
+int vera_port_io_flush(vera_port_io *io) {
+    int flushed = 1;
+    for(unsigned int i = 0; i < io->port_count; i++) {
+        uint32_t *slot;
+        if(io->pending[i] == 0)
+            continue;
+        if(vera_ring_writable(&io->out[i], &slot) > 0) {
+            *slot = io->pending[i];
+            vera_ring_commit(&io->out[i], 1);
+            io->pending[i] = 0;
+        } else {
+            flushed = 0;
+        }
+    }
+    return flushed;
+}
+
+#ifdef VERA_RISCV32
+
+/* Label addresses, in the order the labels are made. Entries of the previous pass are kept,
+   so that forward references resolve to their last known address */
+typedef struct {
+    uint32_t *items;
+    size_t count; /* labels made in the current pass */
+    size_t known; /* labels with an address */
+    size_t capacity;
+} vera_riscv32_labels;
+
+/* State kept from one pass of the assembler to the next. Branches and jumps are numbered in
+   the order they are emitted, and relaxed[site] is the encoding of the site, from 0 for the
+   compressed one : it moves to a longer one once the site doesn't reach its target. It never
+   goes back, so the code only grows and the passes converge */
+typedef struct {
+    vera_riscv32_labels rules;
+    vera_riscv32_labels rejects; /* with ctx->profile, where the rules count their rejections */
+    uint32_t loop_label, end_label;
+    uint32_t halt_label; /* the ebreak */
+    uint32_t code_size;
+    uint32_t data_label; /* the registers, on the first page after the code */
+    uint32_t window; /* the register s0 points to, see vera_riscv32_pin_registers */
+    uint32_t profile_count; /* rules with counters */
+    uint32_t *port_of; /* port index + 1 of every register, 0 if it isn't a port. NULL without ports */
+    const uint32_t *resume; /* see vera_program_resume, NULL with ports */
+    const uint8_t *live; /* see vera_program_live */
+    uint8_t *relaxed;
+    size_t site, site_capacity;
+    unsigned int pass;
+    int changed; /* a label moved or a site was relaxed during the pass */
+} vera_riscv32_asm;
+
+/* Where the sections of the generated program are, in the guest memory */
+typedef struct {
+    uint32_t code_size;
+    uint32_t data_addr;
+    uint32_t halt;
+    uint32_t profile_count;
+} vera_riscv32_layout;
+
+static void vera_riscv32_make_label(vera_riscv32_asm *as, vera_riscv32_labels *labels, uint32_t pc) {
+    if(labels->count == labels->capacity) {
+        labels->capacity = labels->capacity ? 2 * labels->capacity : 256;
+        labels->items = (uint32_t*)realloc(labels->items, labels->capacity * sizeof(uint32_t));
+        if(!labels->items)
+            ERROR("out of memory");
+    }
+    if(labels->count >= labels->known) {
+        labels->known = labels->count + 1;
+        as->changed = 1;
+    } else if(labels->items[labels->count] != pc) {
+        as->changed = 1;
+    }
+    labels->items[labels->count++] = pc;
+}
+
+static uint32_t vera_riscv32_label(const vera_riscv32_labels *labels, size_t i) {
+    return i < labels->known ? labels->items[i] : 0;
+}
+
+static uint8_t *vera_riscv32_site(vera_riscv32_asm *as) {
+    if(as->site == as->site_capacity) {
+        size_t capacity = as->site_capacity ? 2 * as->site_capacity : 1024;
+        as->relaxed = (uint8_t*)realloc(as->relaxed, capacity);
+        if(!as->relaxed)
+            ERROR("out of memory");
+        memset(as->relaxed + as->site_capacity, 0, capacity - as->site_capacity);
+        as->site_capacity = capacity;
+    }
+    return &as->relaxed[as->site++];
+}
+
+/* Returns the encoding of the next site, at least `shortest` (the ones that can't be compressed
+   start at 1), and at least `fitting`, the shortest one that reaches the target. In the first
+   pass the forward labels are unknown, so nothing is relaxed */
+static unsigned int vera_riscv32_relax(vera_riscv32_asm *as, unsigned int shortest, unsigned int fitting) {
+    uint8_t *relaxed = vera_riscv32_site(as);
+    if(*relaxed < shortest)
+        *relaxed = shortest;
+    if(*relaxed < fitting && as->pass > 0) {
+        *relaxed = fitting;
+        as->changed = 1;
+    }
+    return *relaxed;
+}
+
+/* Like vera_riscv32_relax, without consuming the site */
+static unsigned int vera_riscv32_relaxed(const vera_riscv32_asm *as, unsigned int shortest) {
+    const unsigned int relaxed = as->site < as->site_capacity ? as->relaxed[as->site] : 0;
+    return relaxed > shortest ? relaxed : shortest;
+}
+
+#define emit(instr) \
+    do { \
+        uint32_t instr_ = (instr); \
+        if(output && pc + 4 <= max_size) \
+            memcpy(&output[pc], &instr_, 4); \
+        pc += 4; \
+    } while(0)
+#define emit16(instr) \
+    do { \
+        uint16_t instr_ = (uint16_t)(instr); \
+        if(output && pc + 2 <= max_size) \
+            memcpy(&output[pc], &instr_, 2); \
+        pc += 2; \
+    } while(0)
+/* base instructions, always 4 bytes */
+#define I_type(opcode, funct3, rd, rs, imm) emit((opcode) | (funct3) << 12 | ((rd) & 0x1f) << 7 | ((rs) & 0x1f) << 15 | ((uint32_t)(imm) & 0xfff) << 20)
+#define rvi_addi(rd, rs, imm) I_type(0x13, 0, rd, rs, imm)
+#define rv_jal(reg, imm) emit(0x6f | (reg) << 7 | ((uint32_t)(imm) & 0xff000) | ((uint32_t)(imm) & (1 << 11)) << 9 | ((uint32_t)(imm) & 0x7fe) << (21 - 1) | ((uint32_t)(imm) & (1 << 20)) << 11)
+#define rv_jalr(rd, rs, imm) I_type(0x67, 0, rd, rs, imm)
+#define U_type(opcode, rd, imm) emit((opcode) | ((rd) & 0x1f) << 7 | ((uint32_t)(imm) & 0xfffff) << 12)
+#define rvi_lui(rd, imm) U_type(0x37, (rd), (imm))
+#define rv_auipc(rd, imm) U_type(0x17, (rd), (imm))
+#define rvi_lw(rd, rs, imm) I_type(0x3, 0x2, rd, rs, imm)
+#define S_type(opcode, funct3, rs1, rs2, imm) emit((opcode) | ((uint32_t)(imm) & 0x1f) << 7 | (funct3) << 12 | ((rs1) & 0x1f) << 15 | ((rs2) & 0x1f) << 20 | (((uint32_t)(imm) & 0xfe0) << 20))
+#define rvi_sw(rs1, rs2, imm) S_type(0x23, 0x2, rs1, rs2, imm)
+#define B_type(opcode, funct3, rs1, rs2, imm) emit((opcode) | (funct3) << 12 | (((uint32_t)(imm) >> 11) & 0x1) << 7 | (((uint32_t)(imm) >> 1) & 0xf) << 8 | ((rs1) & 0x1f) << 15 | ((rs2) & 0x1f) << 20 | (((uint32_t)(imm) >> 5) & 0x3f) << 25 | (((uint32_t)(imm) >> 12) & 0x1) << 31)
+#define R_type(opcode, funct3, funct7, rd, rs1, rs2) emit((opcode) | ((rd) & 0x1f) << 7 | (funct3) << 12 | ((rs1) & 0x1f) << 15 | ((rs2) & 0x1f) << 20 | funct7 << 25)
+#define rvi_add(rd, rs1, rs2) R_type(0x33, 0, 0, rd, rs1, rs2)
+#define rvi_sub(rd, rs1, rs2) R_type(0x33, 0, 0x20, rd, rs1, rs2)
+#define rv_sltu(rd, rs1, rs2) R_type(0x33, 0x3, 0, rd, rs1, rs2)
+#define rvi_xor(rd, rs1, rs2) R_type(0x33, 0x4, 0, rd, rs1, rs2)
+#define rvi_and(rd, rs1, rs2) R_type(0x33, 0x7, 0, rd, rs1, rs2)
+#define rvi_slli(rd, rs, shamt) I_type(0x13, 0x1, rd, rs, (shamt) & 0x1f)
+#define rv_mul(rd, rs1, rs2) R_type(0x33, 0, 0x1, rd, rs1, rs2)
+#define rvi_break() I_type(0x73, 0x0, 0, 0, 1)
+/* compressed instructions (RVC), 2 bytes. Most of them only have 3 bits for a register : x8-x15 */
+#define RVC_REG(r) ((r) >= 8 && (r) < 16)
+#define FITS_IMM6(x) ((x) >= -(1 << 5) && (x) < (1 << 5))
+#define CI_type(funct3, rd, imm) emit16(0x1 | ((uint32_t)(imm) & 0x1f) << 2 | ((rd) & 0x1f) << 7 | (((uint32_t)(imm) >> 5) & 0x1) << 12 | (funct3) << 13)
+#define CR_type(funct4, rd, rs2) emit16(0x2 | ((rs2) & 0x1f) << 2 | ((rd) & 0x1f) << 7 | (funct4) << 12)
+#define CA_type(funct2, rd, rs2) emit16(0x1 | ((rs2) & 0x7) << 2 | (funct2) << 5 | ((rd) & 0x7) << 7 | 0x23 << 10)
+#define CL_type(funct3, rd, rs1, imm) emit16(((rd) & 0x7) << 2 | (((uint32_t)(imm) >> 6) & 0x1) << 5 | (((uint32_t)(imm) >> 2) & 0x1) << 6 | ((rs1) & 0x7) << 7 | (((uint32_t)(imm) >> 3) & 0x7) << 10 | (funct3) << 13)
+#define rvc_slli(rd, shamt) emit16(0x2 | ((shamt) & 0x1f) << 2 | ((rd) & 0x1f) << 7)
+#define rvc_j(imm) emit16(0x1 | 0x5 << 13 | (((uint32_t)(imm) >> 5) & 0x1) << 2 | (((uint32_t)(imm) >> 1) & 0x7) << 3 | (((uint32_t)(imm) >> 7) & 0x1) << 6 | (((uint32_t)(imm) >> 6) & 0x1) << 7 | (((uint32_t)(imm) >> 10) & 0x1) << 8 | (((uint32_t)(imm) >> 8) & 0x3) << 9 | (((uint32_t)(imm) >> 4) & 0x1) << 11 | (((uint32_t)(imm) >> 11) & 0x1) << 12)
+/* c.beqz (funct3 0) and c.bnez (funct3 1), against zero */
+#define rvc_branch(funct3, rs1, imm) emit16(0x1 | (0x6 | (funct3)) << 13 | (((uint32_t)(imm) >> 5) & 0x1) << 2 | (((uint32_t)(imm) >> 1) & 0x3) << 3 | (((uint32_t)(imm) >> 6) & 0x3) << 5 | ((rs1) & 0x7) << 7 | (((uint32_t)(imm) >> 3) & 0x3) << 10 | (((uint32_t)(imm) >> 8) & 0x1) << 12)
+/* with ctx->rvc, the compressed encoding is used when it exists for the operands */
+#define rv_addi(rd, rs, imm) \
+    do { \
+        if(ctx->rvc && (rd) != zero && (rd) == (rs) && (imm) != 0 && FITS_IMM6(imm)) \
+            CI_type(0x0, rd, imm); /* c.addi */ \
+        else if(ctx->rvc && (rd) != zero && (rs) == zero && FITS_IMM6(imm)) \
+            CI_type(0x2, rd, imm); /* c.li */ \
+        else if(ctx->rvc && (rd) != zero && (rs) != zero && (imm) == 0) \
+            CR_type(0x8, rd, rs); /* c.mv */ \
+        else \
+            rvi_addi(rd, rs, imm); \
+    } while(0)
+#define rv_lui(rd, imm) \
+    do { \
+        if(ctx->rvc && (rd) != zero && (rd) != 2 && ((imm) & 0xfffff) != 0 && (((imm) & 0xfffff) < (1 << 5) || ((imm) & 0xfffff) >= 0xfffe0)) \
+            CI_type(0x3, rd, imm); \
+        else \
+            rvi_lui(rd, imm); \
+    } while(0)
+#define rv_lw(rd, rs, imm) \
+    do { \
+        if(ctx->rvc && RVC_REG(rd) && RVC_REG(rs) && (imm) >= 0 && (imm) < 128 && (imm) % 4 == 0) \
+            CL_type(0x2, rd, rs, imm); \
+        else \
+            rvi_lw(rd, rs, imm); \
+    } while(0)
+#define rv_sw(rs1, rs2, imm) \
+    do { \
+        if(ctx->rvc && RVC_REG(rs1) && RVC_REG(rs2) && (imm) >= 0 && (imm) < 128 && (imm) % 4 == 0) \
+            CL_type(0x6, rs2, rs1, imm); \
+        else \
+            rvi_sw(rs1, rs2, imm); \
+    } while(0)
+#define rv_add(rd, rs1, rs2) \
+    do { \
+        if(ctx->rvc && (rd) != zero && (rd) == (rs1) && (rs2) != zero) \
+            CR_type(0x9, rd, rs2); \
+        else if(ctx->rvc && (rd) != zero && (rd) == (rs2) && (rs1) != zero) \
+            CR_type(0x9, rd, rs1); \
+        else if(ctx->rvc && (rd) != zero && (rs1) == zero && (rs2) != zero) \
+            CR_type(0x8, rd, rs2); \
+        else \
+            rvi_add(rd, rs1, rs2); \
+    } while(0)
+#define rv_sub(rd, rs1, rs2) \
+    do { \
+        if(ctx->rvc && RVC_REG(rd) && (rd) == (rs1) && RVC_REG(rs2)) \
+            CA_type(0x0, rd, rs2); \
+        else \
+            rvi_sub(rd, rs1, rs2); \
+    } while(0)
+/* c.xor and c.and, the operands commute */
+#define rv_logic(funct2, funct3, rd, rs1, rs2) \
+    do { \
+        if(ctx->rvc && RVC_REG(rd) && (rd) == (rs1) && RVC_REG(rs2)) \
+            CA_type(funct2, rd, rs2); \
+        else if(ctx->rvc && RVC_REG(rd) && (rd) == (rs2) && RVC_REG(rs1)) \
+            CA_type(funct2, rd, rs1); \
+        else \
+            R_type(0x33, funct3, 0, rd, rs1, rs2); \
+    } while(0)
+#define rv_xor(rd, rs1, rs2) rv_logic(0x1, 0x4, rd, rs1, rs2)
+#define rv_and(rd, rs1, rs2) rv_logic(0x3, 0x7, rd, rs1, rs2)
+#define rv_slli(rd, rs, shamt) \
+    do { \
+        if(ctx->rvc && (rd) != zero && (rd) == (rs) && ((shamt) & 0x1f) != 0) \
+            rvc_slli(rd, shamt); \
+        else \
+            rvi_slli(rd, rs, shamt); \
+    } while(0)
+#define rv_break() \
+    do { \
+        if(ctx->rvc) \
+            CR_type(0x9, 0, 0); /* c.ebreak */ \
+        else \
+            rvi_break(); \
+    } while(0)
+/* upper and lower parts of a 32 bits offset, for auipc/lui followed by an instruction
+   that sign extends its 12 bits immediate */
+#define HI20(x) (((uint32_t)(x) + 0x800) >> 12)
+#define LO12(x) ((int32_t)((uint32_t)(x) - (HI20(x) << 12)))
+#define FITS_IMM12(x) ((x) >= -(1 << 11) && (x) < (1 << 11))
+/* pseudo instructions */
+#define rv_ret() \
+    do { \
+        if(ctx->rvc) \
+            CR_type(0x8, ra, 0); /* c.jr */ \
+        else \
+            rv_jalr(zero, ra, 0); \
+    } while(0)
+#define rv_li(rd, imm) rv_addi(rd, zero, imm)
+#define rv_mv(rd, rs) rv_addi(rd, rs, 0)
+/* size of the encodings of a jump : c.j reaches +/-2 KiB, jal +/-1 MiB, auipc + jalr the whole
+   address space */
+#define VERA_RISCV32_JUMP_SIZE(encoding) (2 << (encoding))
+#define rv_j(addr) \
+    do { \
+        int32_t j_offset = (int32_t)((addr) - pc); \
+        switch(vera_riscv32_relax(as, !ctx->rvc, j_offset >= -(1 << 11) && j_offset < (1 << 11) ? 0 : j_offset >= -(1 << 20) && j_offset < (1 << 20) ? 1 : 2)) { \
+        case 0: \
+            rvc_j(j_offset); \
+            break; \
+        case 1: \
+            rv_jal(zero, j_offset); \
+            break; \
+        default: \
+            rv_auipc(t4, HI20(j_offset)); \
+            rv_jalr(zero, t4, LO12(j_offset)); \
+        } \
+    } while(0)
+/* conditional branches reach +/-4 KiB, +/-256 bytes for c.beqz and c.bnez. Further targets are
+   reached with the opposite branch over a jump. A branch always takes two sites, its own and
+   the one of the jump */
+#define rv_branch(funct3, rs1, rs2, addr) \
+    do { \
+        int32_t b_offset = (int32_t)((addr) - pc); \
+        const int b_rvc = ctx->rvc && (funct3) < 2 && (rs2) == zero && RVC_REG(rs1); \
+        switch(vera_riscv32_relax(as, !b_rvc, b_rvc && b_offset >= -(1 << 8) && b_offset < (1 << 8) ? 0 : b_offset >= -(1 << 12) && b_offset < (1 << 12) ? 1 : 2)) { \
+        case 0: \
+            rvc_branch(funct3, rs1, b_offset); \
+            vera_riscv32_site(as); \
+            break; \
+        case 1: \
+            B_type(0x63, funct3, rs1, rs2, b_offset); \
+            vera_riscv32_site(as); \
+            break; \
+        default: { \
+            /* the opposite branch skips itself and the jump */ \
+            const int32_t skip = (b_rvc ? 2 : 4) + VERA_RISCV32_JUMP_SIZE(vera_riscv32_relaxed(as, !ctx->rvc)); \
+            if(b_rvc) \
+                rvc_branch((funct3) ^ 1, rs1, skip); \
+            else \
+                B_type(0x63, (funct3) ^ 1, rs1, rs2, skip); \
+            rv_j(addr); \
+        } \
+        } \
+    } while(0)
+#define rv_beq(rs1, rs2, addr) rv_branch(0x0, rs1, rs2, addr)
+#define rv_bne(rs1, rs2, addr) rv_branch(0x1, rs1, rs2, addr)
+#define rv_bgeu(rs1, rs2, addr) rv_branch(0x7, rs1, rs2, addr)
+/* my own pseudo instructions */
+/* the counters close to `base` (kept in s0) are reached with a single instruction, compressed
+   for the first 32 of them after s0 and the next 32 after s1, the other ones relatively to the
+   pc. The offsets of the latter change from one pass to the next, so they always take the
+   4 bytes encoding */
+#define VERA_RISCV32_BASE_REACH 128
+#define rv_load(rd, addr) \
+    do { \
+        int32_t offset = (int32_t)((addr) - base); \
+        if(offset >= VERA_RISCV32_BASE_REACH && offset < 2 * VERA_RISCV32_BASE_REACH) { \
+            rv_lw(rd, s1, offset - VERA_RISCV32_BASE_REACH); \
+        } else if(FITS_IMM12(offset)) { \
+            rv_lw(rd, s0, offset); \
+        } else { \
+            offset = (int32_t)((addr) - pc); \
+            rv_auipc(rd, HI20(offset)); \
+            rvi_lw(rd, rd, LO12(offset)); \
+        } \
+    } while(0)
+#define rv_store(data_reg, temp_reg, addr) \
+    do { \
+        int32_t offset = (int32_t)((addr) - base); \
+        if(offset >= VERA_RISCV32_BASE_REACH && offset < 2 * VERA_RISCV32_BASE_REACH) { \
+            rv_sw(s1, data_reg, offset - VERA_RISCV32_BASE_REACH); \
+        } else if(FITS_IMM12(offset)) { \
+            rv_sw(s0, data_reg, offset); \
+        } else { \
+            offset = (int32_t)((addr) - pc); \
+            rv_auipc(temp_reg, HI20(offset)); \
+            rvi_sw(temp_reg, data_reg, LO12(offset)); \
+        } \
+    } while(0)
+#define rv_load_i32_imm(rd, imm) \
+    do { \
+        if(FITS_IMM12(imm)) { \
+            rv_li((rd), (imm)); \
+        } else { \
+            rv_lui((rd), HI20(imm)); \
+            if(LO12(imm)) \
+                rv_addi((rd), (rd), LO12(imm)); \
+        } \
+    } while(0)
+#define rv_increment(addr) \
+    do { \
+        rv_load(a4, addr); \
+        rv_addi(a4, a4, 1); \
+        rv_store(a4, a5, addr); \
+    } while(0)
+
+#define VERA_RISCV32_PINNED_COUNT 10
+
+/* returns n if x == 2^n, -1 otherwise */
+static int vera_log2(uint64_t x) {
+    int n = 0;
+    if(x == 0 || (x & (x - 1)))
+        return -1;
+    while(x >>= 1)
+        n++;
+    return n;
+}
+
+/* Gives the counters most referenced by the live rules a callee-saved register (s2-s11) for
+   the whole run, `pinned` is 0 for the counters that stay in memory. The sinks, only written,
+   are left in memory : the registers go to the counters checked when looking for a rule.
+   Returns the first counter of the window the base registers s0 and s1 point to : the run of
+   counters within reach of their compressed loads and stores that stay in memory and are the
+   most referenced */
+static uint32_t vera_riscv32_pin_registers(const vera_program *prog, const uint8_t *live, uint8_t *pinned) {
+    static const uint8_t saved[VERA_RISCV32_PINNED_COUNT] = { 18, 19, 20, 21, 22, 23, 24, 25, 26, 27 };
+    const uint32_t window_size = 2 * VERA_RISCV32_BASE_REACH / 4;
+    uint32_t window = 0;
+    uint32_t *uses = (uint32_t*)vera_alloc((prog->register_count ? prog->register_count : 1) * sizeof(uint32_t));
+    uint8_t *read = (uint8_t*)vera_alloc(prog->register_count ? prog->register_count : 1);
+    for(unsigned int j = 0; j < prog->register_count; j++) {
+        uses[j] = 0;
+        read[j] = 0;
+        pinned[j] = 0;
+    }
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++) {
+        if(!live[rule])
+            continue;
+        for(uint32_t k = prog->lhs_start[rule]; k < prog->lhs_start[rule + 1]; k++) {
+            uses[prog->lhs[k]]++; /* load */
+            read[prog->lhs[k]] = 1;
+        }
+        for(uint32_t k = prog->effect_start[rule]; k < prog->effect_start[rule + 1]; k++)
+            uses[prog->effect_reg[k]] += 2; /* load and store */
+    }
+    for(unsigned int k = 0; k < VERA_RISCV32_PINNED_COUNT; k++) {
+        int best = -1;
+        for(unsigned int j = 0; j < prog->register_count; j++) {
+            if(!pinned[j] && read[j] && (best < 0 || uses[j] > uses[best]))
+                best = j;
+        }
+        if(best < 0)
+            break;
+        pinned[best] = saved[k];
+    }
+    uint64_t sum = 0, best_sum;
+    for(uint32_t j = 0; j < prog->register_count && j < window_size; j++)
+        sum += pinned[j] ? 0 : uses[j];
+    best_sum = sum;
+    for(uint32_t j = window_size; j < prog->register_count; j++) {
+        sum += pinned[j] ? 0 : uses[j];
+        sum -= pinned[j - window_size] ? 0 : uses[j - window_size];
+        if(sum > best_sum) {
+            best_sum = sum;
+            window = j - window_size + 1;
+        }
+    }
+    free(uses);
+    free(read);
+    return window;
+}
+
+/* Assembler inspired by https://zserge.com/posts/post-apocalyptic-programming/
+   The generated program starts at address 0 and fires rules until none applies, or until
+   it has fired a1 rules (no limit if a1 is 0). Then it executes an ebreak, with the number
+   of firings in a0. With a non zero ctx->port_mmio_base, the ports are polled before every scan
+   of the rules and the increments of the ports are stored to the host (see vera_port_io).
+   One pass of the assembler : the labels and the relaxed sites come from the previous pass,
+   nothing is written past max_size bytes, and the size of the program is returned */
+
+#define REGISTER(j) (as->data_label + 4 * (j))
+/* the fired and rejected counters of a rule */
+#define FIRED(rule) REGISTER(ctx->register_count + 2 * (rule))
+#define REJECTED(rule) REGISTER(ctx->register_count + 2 * (rule) + 1)
+
+static size_t vera_riscv32_assemble(vera_ctx *ctx, const vera_program *prog, vera_riscv32_asm *as,
+                                    const uint8_t *pinned, uint8_t *output, size_t max_size) {
+    uint32_t pc = 0;
+    /* risc-v registers, the temporaries are in x8-x15 for the compressed instructions */
+    const uint8_t zero = 0, ra = 1, s0 = 8, s1 = 9, a0 = 10, a1 = 11, a2 = 12, a3 = 13, a4 = 14, a5 = 15, t4 = 29;
+    /* **************** */
+    as->rules.count = as->rejects.count = 0;
+    as->site = 0;
+    as->changed = 0;
+    /* s0 points to the window of registers, s1 right after the first compressed reach. The
+       512 registers before it and after it are in reach of a lw/sw */
+    const uint32_t base = REGISTER(as->window);
+
+    /* the entry point is at address 0 */
+    rv_auipc(s0, HI20(base - pc));
+    rvi_addi(s0, s0, LO12(base - (pc - 4))); /* the offset changes from one pass to the next */
+    rv_addi(s1, s0, VERA_RISCV32_BASE_REACH);
+    for(unsigned int j = 0; j < ctx->register_count; j++) {
+        if(pinned[j])
+            rv_load(pinned[j], REGISTER(j));
+    }
+    rv_li(a0, 0);
+    /* every scan of the rules starts by adding the increments sent by the host to the ports */
+    as->loop_label = pc;
+    for(unsigned int p = 0; as->port_of && p < ctx->port_count; p++) {
+        const uint32_t reg = vera_get_obj(ctx, p)->intern;
+        rv_load_i32_imm(a5, ctx->port_mmio_base + 8 * p);
+        rv_lw(a4, a5, 0);
+        if(pinned[reg]) {
+            rv_add(pinned[reg], pinned[reg], a4);
+        } else {
+            rv_load(a2, REGISTER(reg));
+            rv_add(a2, a2, a4);
+            rv_store(a2, a5, REGISTER(reg));
+        }
+    }
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++) {
+        vera_riscv32_make_label(as, &as->rules, pc);
+        const uint32_t next_rule = vera_riscv32_label(&as->rules, as->rules.count);
+        const uint32_t reject = ctx->profile ? vera_riscv32_label(&as->rejects, rule) : next_rule;
+        if(!as->live[rule]) {
+            /* the rule never applies, the scan goes on with the next one */
+            if(ctx->profile)
+                vera_riscv32_make_label(as, &as->rejects, pc);
+            continue;
+        }
+        /* we will use a3 to compute the min of the lhs */
+        for(uint32_t k = prog->lhs_start[rule]; k < prog->lhs_start[rule + 1]; k++) {
+            const uint32_t reg = prog->lhs[k];
+            uint8_t value = pinned[reg];
+            if(!value) {
+                value = a2;
+                rv_load(a2, REGISTER(reg));
+            }
+            rv_beq(value, zero, reject); /* we skip to next rule if one of the registers is zero */
+            if(k == prog->lhs_start[rule]) {
+                rv_mv(a3, value);
+            } else {
+                /* branchless a3 = min(a3, value) : a3 ^= (a3 ^ value) & -(value < a3) */
+                rv_sltu(a4, value, a3);
+                rv_sub(a4, zero, a4);
+                rv_xor(a5, value, a3);
+                rv_and(a5, a5, a4);
+                rv_xor(a3, a3, a5);
+            }
+        }
+        for(uint32_t k = prog->effect_start[rule]; k < prog->effect_start[rule + 1]; k++) {
+            const uint32_t j = prog->effect_reg[k];
+            const int32_t diff = prog->effect_diff[k];
+            const uint8_t value = pinned[j] ? pinned[j] : a2;
+            const int shift = vera_log2(diff < 0 ? -(int64_t)diff : diff);
+            if(as->port_of && as->port_of[j] && diff > 0) {
+                /* the increments of a port go to the host instead of the counter */
+                if(diff == 1) {
+                    rv_mv(a4, a3);
+                } else if(shift >= 0) {
+                    rv_slli(a4, a3, shift);
+                } else {
+                    rv_load_i32_imm(a4, diff);
+                    rv_mul(a4, a4, a3);
+                }
+                rv_load_i32_imm(a5, ctx->port_mmio_base + 8 * (as->port_of[j] - 1) + 4);
+                rv_sw(a5, a4, 0);
+                continue;
+            }
+            if(!pinned[j])
+                rv_load(a2, REGISTER(j));
+            /* value += diff * a3, without a multiplication for the common diffs */
+            if(diff == 1) {
+                rv_add(value, value, a3);
+            } else if(diff == -1) {
+                rv_sub(value, value, a3);
+            } else if(shift >= 0) {
+                rv_slli(a4, a3, shift);
+                if(diff > 0)
+                    rv_add(value, value, a4);
+                else
+                    rv_sub(value, value, a4);
+            } else {
+                rv_load_i32_imm(a4, diff);
+                rv_mul(a4, a4, a3);
+                rv_add(value, value, a4);
+            }
+            if(!pinned[j])
+                rv_store(a2, a4, REGISTER(j));
+        }
+        if(ctx->profile)
+            rv_increment(FIRED(rule));
+        /* a0 counts the firings, we stop when it reaches the fuel in a1 (never if a1 is 0) */
+        rv_addi(a0, a0, 1);
+        rv_beq(a0, a1, as->end_label);
+        /* the ports are polled before every full scan */
+        if(as->resume && as->resume[rule] > 0) {
+            /* without the counters, the next rule is right after this one */
+            if(as->resume[rule] != rule + 1 || ctx->profile)
+                rv_j(vera_riscv32_label(&as->rules, as->resume[rule]));
+        } else {
+            rv_j(as->loop_label);
+        }
+        if(ctx->profile) {
+            vera_riscv32_make_label(as, &as->rejects, pc);
+            rv_increment(REJECTED(rule));
+        }
+    }
+    /* make a new (empty) rule label so that the last rule can make a jump here */
+    vera_riscv32_make_label(as, &as->rules, pc);
+    if(as->end_label != pc)
+        as->changed = 1;
+    as->end_label = pc;
+    for(unsigned int j = 0; j < ctx->register_count; j++) {
+        if(pinned[j])
+            rv_store(pinned[j], a4, REGISTER(j));
+    }
+    as->halt_label = pc;
+    rv_break();
+    rv_ret();
+    as->code_size = pc;
+    const uint32_t data = (pc + VERA_RISCV32_PAGE_SIZE - 1) & ~(uint32_t)(VERA_RISCV32_PAGE_SIZE - 1);
+    if(as->data_label != data)
+        as->changed = 1;
+    as->data_label = data;
+    if(pc & 2)
+        emit16(0);
+    while(pc < data)
+        emit(0);
+    as->profile_count = ctx->profile ? as->rules.count - 1 : 0;
+    for(unsigned int j = 0; j < ctx->register_count + 2 * as->profile_count; j++)
+        emit(0);
+    return pc;
+}
+
+/* Assembles the program, passes are repeated until no label moves */
+static size_t vera_riscv32_generate(vera_ctx *ctx, uint8_t *output, size_t max_size, vera_riscv32_layout *layout) {
+    vera_riscv32_asm as;
+    size_t size;
+    memset(&as, 0, sizeof(as));
+    vera_program prog;
+    vera_program_init(&prog, ctx);
+    if(ctx->port_mmio_base && ctx->port_count) {
+        as.port_of = (uint32_t*)vera_alloc(ctx->register_count * sizeof(uint32_t));
+        memset(as.port_of, 0, ctx->register_count * sizeof(uint32_t));
+        for(unsigned int p = 0; p < ctx->port_count; p++)
+            as.port_of[vera_get_obj(ctx, p)->intern] = p + 1;
+    }
+    /* with ports, the increments sent by the host can make any rule apply */
+    if(!as.port_of)
+        as.resume = prog.resume;
+    /* the rules that can't fire from the initial registers, even with the host writing to the ports */
+    uint32_t *initial = (uint32_t*)vera_alloc((ctx->register_count ? ctx->register_count : 1) * sizeof(uint32_t));
+    uint8_t *ports = (uint8_t*)vera_alloc(ctx->register_count ? ctx->register_count : 1);
+    uint8_t *live = (uint8_t*)vera_alloc(prog.rule_count ? prog.rule_count : 1);
+    memset(initial, 0, ctx->register_count * sizeof(uint32_t));
+    memset(ports, 0, ctx->register_count);
+    vera_fill_registers(ctx, initial);
+    for(unsigned int p = 0; p < ctx->port_count; p++)
+        ports[vera_get_obj(ctx, p)->intern] = 1;
+    vera_program_live(&prog, initial, ports, live);
+    as.live = live;
+    /* the counters kept in s2-s11, loaded on entry and stored back before the ebreak */
+    uint8_t *pinned = (uint8_t*)vera_alloc(ctx->register_count ? ctx->register_count : 1);
+    as.window = vera_riscv32_pin_registers(&prog, live, pinned);
+    do {
+        size = vera_riscv32_assemble(ctx, &prog, &as, pinned, output, max_size);
+        as.pass++;
+    } while(as.changed);
+    if(output && size <= max_size)
+        vera_fill_registers(ctx, (uint32_t*)(output + as.data_label));
+    if(layout) {
+        layout->code_size = as.code_size;
+        layout->data_addr = as.data_label;
+        layout->halt = as.halt_label;
+        layout->profile_count = as.profile_count;
+    }
+    vera_program_free(&prog);
+    free(initial);
+    free(ports);
+    free(live);
+    free(as.rules.items);
+    free(as.rejects.items);
+    free(as.relaxed);
+    free(as.port_of);
+    free(pinned);
+    return size;
+}
+
+/* Returns the size of the program, which is written (with the initial values of the registers)
+   only if it fits in max_size bytes. `output` may be NULL to get the size. The code starts at
+   address 0, and the registers are on the first page after it. They end the program, unless
+   they are followed by the counters of ctx->profile */
+size_t vera_riscv32_codegen(vera_ctx *ctx, uint8_t *output, size_t max_size) {
+    return vera_riscv32_generate(ctx, output, max_size, NULL);
+}
+
+static uint64_t vera_fnv64(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char*)data;
+    for(size_t i = 0; i < len; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211u;
+    return hash;
+}
+
+static size_t vera_source_len(vera_ctx *ctx) {
+    if(ctx->buffer)
+        return ctx->buffer_size;
+    if(ctx->len == SIZE_MAX)
+        return slen(ctx->src);
+    return ctx->len;
+}
+
+/* Hash of everything the code depends on */
+static uint64_t vera_source_hash(vera_ctx *ctx) {
+    const uint32_t options[7] = { VERA_IMAGE_VERSION, VERA_CODEGEN_REVISION, 32 /* riscv32 */, ctx->port_mmio_base,
+                                  ctx->port_count, ctx->profile, ctx->rvc };
+    uint64_t hash = vera_fnv64(14695981039346656037u, options, sizeof(options));
+    for(unsigned int p = 0; p < ctx->port_count; p++)
+        hash = vera_fnv64(hash, ctx->ports[p], slen(ctx->ports[p]) + 1);
+    return vera_fnv64(hash, ctx->src, vera_source_len(ctx));
+}
+
+/* Writes the canonical form of the string : no leading or trailing spaces, and a single ' '
+   for every run of spaces, like vera_scmp sees it. Returns its length */
+static size_t vera_canonical(char *out, vera_string vstr) {
+    size_t i = 0, len = vstr.len, n = 0;
+    while(i < len && isspace(vstr.string[i]))
+        i++;
+    while(len > i && isspace(vstr.string[len - 1]))
+        len--;
+    while(i < len) {
+        if(isspace(vstr.string[i])) {
+            while(isspace(vstr.string[i]))
+                i++;
+            out[n++] = ' ';
+        } else {
+            out[n++] = vstr.string[i++];
+        }
+    }
+    return n;
+}
+
+#define VERA_PAGE_ALIGN(x) (((x) + VERA_RISCV32_PAGE_SIZE - 1) & ~(size_t)(VERA_RISCV32_PAGE_SIZE - 1))
+
+/* Compiles the parsed and interned program into a newly allocated image (see vera_image_header),
+   with the header on the first page. Returns the size of the image */
+size_t vera_riscv32_image(vera_ctx *ctx, uint8_t **image) {
+    vera_riscv32_layout layout;
+    vera_image_header header;
+    const size_t size = vera_riscv32_generate(ctx, NULL, 0, &layout);
+    memset(&header, 0, sizeof(header));
+    header.magic = VERA_IMAGE_MAGIC;
+    header.version = VERA_IMAGE_VERSION;
+    header.entry = 0;
+    header.code_offset = VERA_RISCV32_PAGE_SIZE;
+    header.code_addr = 0;
+    header.code_size = layout.code_size;
+    header.data_offset = header.code_offset + layout.data_addr;
+    header.data_addr = layout.data_addr;
+    header.data_size = (ctx->register_count + 2 * layout.profile_count) * 4;
+    header.halt = layout.halt;
+    header.register_count = ctx->register_count;
+    header.port_count = ctx->port_count;
+    header.port_mmio_base = ctx->port_mmio_base;
+    header.profile_count = layout.profile_count;
+    header.strings_offset = VERA_PAGE_ALIGN(header.data_offset + header.data_size);
+    header.source_hash = vera_source_hash(ctx);
+    /* the names are never longer than in the source */
+    size_t strings_capacity = 1;
+    for(size_t i = 0; i < ctx->obj_count; i++)
+        strings_capacity += vera_get_obj(ctx, i)->len + 1;
+    uint8_t *file = (uint8_t*)vera_alloc(header.strings_offset + strings_capacity);
+    memset(file, 0, header.strings_offset);
+    vera_riscv32_generate(ctx, file + header.code_offset, size, NULL);
+    /* the first object of every register gives its name */
+    char *strings = (char*)file + header.strings_offset;
+    size_t strings_size = 0;
+    int next = 0;
+    for(size_t i = 0; i < ctx->obj_count; i++) {
+        vera_obj *obj = vera_get_obj(ctx, i);
+        if((obj->type == VERA_FACT || obj->type == VERA_PORT) && obj->intern == next) {
+            strings_size += vera_canonical(strings + strings_size, vera_obj_string(ctx, obj));
+            strings[strings_size++] = '\0';
+            next++;
+        }
+    }
+    if(strings_size == 0)
+        strings[strings_size++] = '\0';
+    header.strings_size = strings_size;
+    memcpy(file, &header, sizeof(header));
+    *image = file;
+    return header.strings_offset + strings_size;
+}
+
+/* Returns 1 if the image is complete and its sections are where vera_riscv32_image puts them */
+int vera_image_check(const uint8_t *image, size_t size) {
+    vera_image_header header;
+    if(size < sizeof(header))
+        return 0;
+    memcpy(&header, image, sizeof(header));
+    if(header.magic != VERA_IMAGE_MAGIC || header.version != VERA_IMAGE_VERSION)
+        return 0;
+    if(header.code_addr != 0 || header.entry >= header.code_size || header.code_size > header.data_addr)
+        return 0;
+    if(header.data_offset != (uint64_t)header.code_offset + header.data_addr || header.data_size != ((uint64_t)header.register_count + 2 * (uint64_t)header.profile_count) * 4)
+        return 0;
+    if((uint64_t)header.data_offset + header.data_size > header.strings_offset)
+        return 0;
+    if((uint64_t)header.strings_offset + header.strings_size != size)
+        return 0;
+    return header.strings_size > 0 && image[size - 1] == '\0';
+}
+
+/* Name of the register j of a checked image, NULL if there is no such register */
+const char *vera_image_name(const uint8_t *image, unsigned int j) {
+    vera_image_header header;
+    memcpy(&header, image, sizeof(header));
+    if(j >= header.register_count)
+        return NULL;
+    const char *name = (const char*)image + header.strings_offset;
+    const char *end = name + header.strings_size;
+    while(j-- && name < end)
+        name += slen(name) + 1;
+    return name < end ? name : NULL;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+/* Compile cache. The files are images named after their source_hash, so an entry never needs
+   to be invalidated : a different source, port list or option gives another name. Files are
+   written under a temporary name then renamed, so the processes sharing the cache only ever
+   see complete files */
+
+/* Points the artifact into an image, returns 0 if it isn't valid */
+static int vera_artifact_from(vera_artifact *artifact, const uint8_t *image, size_t size, uint64_t key) {
+    vera_image_header header;
+    if(!vera_image_check(image, size))
+        return 0;
+    memcpy(&header, image, sizeof(header));
+    if(header.source_hash != key)
+        return 0;
+    artifact->image = image;
+    artifact->image_size = size;
+    artifact->code = image + header.code_offset;
+    artifact->code_size = header.data_addr + header.data_size;
+    artifact->register_count = header.register_count;
+    artifact->names = (const char*)image + header.strings_offset;
+    return 1;
+}
+
+static int vera_cache_map(const char *path, vera_artifact *artifact, uint64_t key) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return 0;
+    if(fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return 0;
+    if(!vera_artifact_from(artifact, (const uint8_t*)map, st.st_size, key)) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    artifact->map = map;
+    artifact->map_size = st.st_size;
+    return 1;
+}
+
+static int vera_write_all(int fd, const uint8_t *data, size_t size) {
+    while(size > 0) {
+        ssize_t n = write(fd, data, size);
+        if(n <= 0)
+            return 0;
+        data += n;
+        size -= n;
+    }
+    return 1;
+}
+
+/* Gives the compiled program of `ctx`, which must be initialized but not parsed yet (ports and
+   port_mmio_base included). On a hit the cached file is only mapped, otherwise the program is
+   compiled and stored in `cache_dir`. Returns 1 on a hit. If the cache can't be written,
+   the artifact is kept in memory */
+int vera_riscv32_compile_cached(const char *cache_dir, vera_ctx *ctx, vera_artifact *artifact) {
+    const uint64_t key = vera_source_hash(ctx);
+    char path[4096], tmp_path[4096 + 64];
+    static unsigned int tmp_counter = 0;
+    memset(artifact, 0, sizeof(*artifact));
+    const int cached = snprintf(path, sizeof(path), "%s/%016llx.vera", cache_dir, (unsigned long long)key) < sizeof(path);
+    if(cached && vera_cache_map(path, artifact, key))
+        return 1;
+
+    vera_parse(ctx);
+    vera_intern_strings(ctx);
+    uint8_t *file;
+    const size_t size = vera_riscv32_image(ctx, &file);
+
+    /* the threads of a process writing the same entry need their own temporary file */
+#if defined(__GNUC__)
+    const unsigned int tmp_id = __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED);
+#else
+    const unsigned int tmp_id = tmp_counter++;
+#endif
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.%u.tmp", path, (long)getpid(), tmp_id);
+    int fd = cached ? open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0644) : -1;
+    if(fd >= 0) {
+        const int written = vera_write_all(fd, file, size) && fsync(fd) == 0;
+        close(fd);
+        if(written && rename(tmp_path, path) == 0 && vera_cache_map(path, artifact, key)) {
+            free(file);
+            return 0;
+        }
+        unlink(tmp_path);
+    }
+    vera_artifact_from(artifact, file, size, key);
+    artifact->buffer = file;
+    return 0;
+}
+
+void vera_artifact_free(vera_artifact *artifact) {
+    if(artifact->map)
+        munmap(artifact->map, artifact->map_size);
+    free(artifact->buffer);
+    memset(artifact, 0, sizeof(*artifact));
+}
+
+#endif
+
+#endif
+
+#ifdef VERA_X86_64
+
+#include <sys/mman.h>
+
+#define x86_emit8(byte) \
+    do { \
+        if(output) \
+            output[pc] = (uint8_t)(byte); \
+        pc++; \
+    } while(0)
+#define x86_emit32(word) \
+    do { \
+        uint32_t w = (uint32_t)(word); \
+        x86_emit8(w); \
+        x86_emit8(w >> 8); \
+        x86_emit8(w >> 16); \
+        x86_emit8(w >> 24); \
+    } while(0)
+/* eax, ecx, edx, rdi (first argument) and esi (second argument) are the only registers used */
+#define x86_mov_ecx_imm(imm) do { x86_emit8(0xb9); x86_emit32(imm); } while(0)
+#define x86_mov_eax_mem(disp) do { x86_emit8(0x8b); x86_emit8(0x87); x86_emit32(disp); } while(0) /* mov eax, [rdi + disp] */
+#define x86_add_mem_ecx(disp) do { x86_emit8(0x01); x86_emit8(0x8f); x86_emit32(disp); } while(0) /* add [rdi + disp], ecx */
+#define x86_sub_mem_ecx(disp) do { x86_emit8(0x29); x86_emit8(0x8f); x86_emit32(disp); } while(0) /* sub [rdi + disp], ecx */
+#define x86_add_mem_eax(disp) do { x86_emit8(0x01); x86_emit8(0x87); x86_emit32(disp); } while(0) /* add [rdi + disp], eax */
+#define x86_imul_eax_ecx_imm(imm) do { x86_emit8(0x69); x86_emit8(0xc1); x86_emit32(imm); } while(0) /* eax = ecx * imm */
+#define x86_test_eax_eax() do { x86_emit8(0x85); x86_emit8(0xc0); } while(0)
+#define x86_cmp_eax_ecx() do { x86_emit8(0x39); x86_emit8(0xc8); } while(0)
+#define x86_cmovb_ecx_eax() do { x86_emit8(0x0f); x86_emit8(0x42); x86_emit8(0xc8); } while(0)
+#define x86_xor_edx_edx() do { x86_emit8(0x31); x86_emit8(0xd2); } while(0)
+#define x86_inc_edx() do { x86_emit8(0xff); x86_emit8(0xc2); } while(0)
+#define X86_INC_MEM_SIZE 6
+#define x86_inc_mem(disp) do { x86_emit8(0xff); x86_emit8(0x87); x86_emit32(disp); } while(0) /* inc dword [rdi + disp] */
+#define x86_cmp_edx_esi() do { x86_emit8(0x39); x86_emit8(0xf2); } while(0)
+#define x86_mov_eax_edx() do { x86_emit8(0x89); x86_emit8(0xd0); } while(0)
+#define x86_jz(addr) do { x86_emit8(0x0f); x86_emit8(0x84); x86_emit32((addr) - (pc + 4)); } while(0)
+#define x86_jmp(addr) do { x86_emit8(0xe9); x86_emit32((addr) - (pc + 4)); } while(0)
+#define x86_ret() x86_emit8(0xc3)
+
+/* The labels are computed during the first pass (with `output` == NULL),
+   every instruction has a fixed size so they don't change in the second pass.
+   With `profile`, the counters of vera_profile follow the registers */
+static size_t vera_x86_64_assemble(const vera_program *prog, uint8_t *output, uint32_t *rules_labels, int profile) {
+    uint32_t pc = 0;
+    /* edx counts the firings */
+    x86_xor_edx_edx();
+    for(unsigned int rule = 0; rule < prog->rule_count; rule++) {
+        const uint32_t fired = 4 * (prog->register_count + 2 * rule);
+        /* a rejected rule counts it just before the next rule */
+        const uint32_t reject = profile ? rules_labels[rule + 1] - X86_INC_MEM_SIZE : rules_labels[rule + 1];
+        rules_labels[rule] = pc;
+        /* ecx is the min of the lhs */
+        x86_mov_ecx_imm(0xffffffff);
+        for(uint32_t k = prog->lhs_start[rule]; k < prog->lhs_start[rule + 1]; k++) {
+            x86_mov_eax_mem(4 * prog->lhs[k]);
+            x86_test_eax_eax();
+            x86_jz(reject); /* we skip to next rule if one of the registers is zero */
+            x86_cmp_eax_ecx();
+            x86_cmovb_ecx_eax();
+        }
+        for(uint32_t k = prog->effect_start[rule]; k < prog->effect_start[rule + 1]; k++) {
+            const int32_t diff = prog->effect_diff[k];
+            const uint32_t disp = 4 * prog->effect_reg[k];
+            if(diff == 1) {
+                x86_add_mem_ecx(disp);
+            } else if(diff == -1) {
+                x86_sub_mem_ecx(disp);
+            } else {
+                x86_imul_eax_ecx_imm(diff);
+                x86_add_mem_eax(disp);
+            }
+        }
+        if(profile)
+            x86_inc_mem(fired);
+        x86_inc_edx();
+        x86_cmp_edx_esi();
+        x86_jz(rules_labels[prog->rule_count]);
+        x86_jmp(rules_labels[prog->resume[rule]]);
+        if(profile)
+            x86_inc_mem(fired + 4);
+    }
+    rules_labels[prog->rule_count] = pc;
+    x86_mov_eax_edx();
+    x86_ret();
+    return pc;
+}
+
+void vera_x86_64_codegen(vera_ctx *ctx, vera_x86_64_code *code) {
+    vera_program prog;
+    vera_program_init(&prog, ctx);
+    uint32_t *rules_labels = (uint32_t*)vera_alloc((prog.rule_count + 1) * sizeof(uint32_t));
+    for(unsigned int i = 0; i <= prog.rule_count; i++)
+        rules_labels[i] = 0;
+    code->size = vera_x86_64_assemble(&prog, NULL, rules_labels, ctx->profile);
+    code->code = mmap(NULL, code->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code->code == MAP_FAILED)
+        ERROR("mmap failed");
+    vera_x86_64_assemble(&prog, (uint8_t*)code->code, rules_labels, ctx->profile);
+    if(mprotect(code->code, code->size, PROT_READ | PROT_EXEC) != 0)
+        ERROR("mprotect failed");
+    /* ISO C doesn't allow casting a data pointer to a function pointer */
+    union { void *ptr; vera_x86_64_fn fn; } entry;
+    entry.ptr = code->code;
+    code->run = entry.fn;
+    free(rules_labels);
+    vera_program_free(&prog);
+}
+
+void vera_x86_64_free(vera_x86_64_code *code) {
+    munmap(code->code, code->size);
+    code->code = NULL;
+    code->run = NULL;
+}
+
+#endif
+
+void vera_compile(vera_ctx *ctx) {
+
+}
+
+#undef SKIP_PORTS
+#undef SKIP_RULE
+#undef SKIP_RULES_WITH_EMPTY_LHS
+
 #undef ERROR
 
 #endif